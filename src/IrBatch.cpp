@@ -0,0 +1,241 @@
+/*
+ * Multi-threaded conversion of signal capture archives
+ */
+
+#include "IrBatch.h"
+#include "TiqiaaUsb.h"
+#include <ctype.h>
+
+IrBatch::IrBatch(){
+	OutputFormat = FormatLibrary;
+	Freq = (int)IrSignal::DefaultFreq;
+	MaxGap = (uint32_t)IrSignal::DefaultMaxGap;
+	ThreadCount = 0;
+	FailCount = 0;
+	Elapsed = 0;
+}
+
+IrBatch::~IrBatch(){
+	size_t i;
+
+	for (i = 0; i < Workers.size(); i++){
+		DeleteCriticalSection(&Workers[i]->QueueCs);
+		delete Workers[i];
+	}
+}
+
+int IrBatch::AddDirectory(const char * path){
+	size_t Count = Files.size();
+	std::string Dir = path;
+
+	while ((Dir.size() > 1) && ((Dir[Dir.size() - 1] == '\\') || (Dir[Dir.size() - 1] == '/'))) Dir.resize(Dir.size() - 1);
+	AddFiles(Dir, "");
+	return (int)(Files.size() - Count);
+}
+
+void IrBatch::AddFiles(const std::string &dir, const std::string &prefix){
+	WIN32_FIND_DATAA FindData;
+	HANDLE FindHandle;
+	std::string Name;
+	size_t i;
+
+	FindHandle = FindFirstFileA((dir + "\\*").c_str(), &FindData);
+	if (FindHandle == INVALID_HANDLE_VALUE) return;
+	do {
+		Name = FindData.cFileName;
+		if ((Name == ".") || (Name == "..")) continue;
+		if (FindData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY){
+			AddFiles(dir + "\\" + Name, prefix + Name + "_");
+		} else if ((Name.size() > 4) && (_stricmp(Name.c_str() + Name.size() - 4, ".bin") == 0)){
+			Files.push_back(dir + "\\" + Name);
+			//signal name is relative path without extension
+			Name = prefix + Name.substr(0, Name.size() - 4);
+			for (i = 0; i < Name.size(); i++){
+				if (!isalnum((unsigned char)Name[i]) && (Name[i] != '-')) Name[i] = '_';
+			}
+			Names.push_back(Name);
+		}
+	} while (FindNextFileA(FindHandle, &FindData));
+	FindClose(FindHandle);
+}
+
+DWORD WINAPI IrBatch::RunWorkerFn(Worker * w)
+{
+	if (w != NULL) w->Owner->WorkerFn(w);
+	return 0;
+}
+
+bool IrBatch::NextTask(Worker * w, size_t * task){
+	Worker * Victim;
+	size_t i;
+	bool res = false;
+
+	//owner takes files from the back of its queue, which is the start of its range, in ascending order
+	EnterCriticalSection(&w->QueueCs);
+	if (!w->Queue.empty()){
+		*task = w->Queue.back();
+		w->Queue.pop_back();
+		res = true;
+	}
+	LeaveCriticalSection(&w->QueueCs);
+	if (res) return true;
+
+	//steal from the front of other queues, the far end of victim range, away from files its owner works on
+	for (i = 1; i < Workers.size(); i++){
+		Victim = Workers[(w->Index + i) % Workers.size()];
+		EnterCriticalSection(&Victim->QueueCs);
+		if (!Victim->Queue.empty()){
+			*task = Victim->Queue.front();
+			Victim->Queue.pop_front();
+			res = true;
+		}
+		LeaveCriticalSection(&Victim->QueueCs);
+		if (res){
+			w->StealCount ++;
+			return true;
+		}
+	}
+	return false;
+}
+
+void IrBatch::WorkerFn(Worker * w){
+	size_t Task;
+
+	//all tasks are queued before workers start, so no task can appear after all queues are empty
+	while (NextTask(w, &Task)){
+		if (!ConvertFile(w, Task)) InterlockedIncrement(&FailCount);
+	}
+}
+
+bool IrBatch::ConvertFile(Worker * w, size_t task){
+	HANDLE File;
+	HANDLE Mapping = NULL;
+	LARGE_INTEGER FileSize;
+	const uint8_t * Data;
+	DWORD ReadSize;
+	IrSignal Signal;
+	bool res;
+
+	File = CreateFileA(Files[task].c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (File == INVALID_HANDLE_VALUE) return false;
+	if (!GetFileSizeEx(File, &FileSize) || (FileSize.QuadPart == 0) || (FileSize.QuadPart > 0x7FFFFFFF)){
+		CloseHandle(File);
+		return false;
+	}
+	if (FileSize.QuadPart <= ReadBufSize){
+		if (!ReadFile(File, &w->ReadBuf[0], (DWORD)FileSize.QuadPart, &ReadSize, NULL) || ((LONGLONG)ReadSize != FileSize.QuadPart)){
+			CloseHandle(File);
+			return false;
+		}
+		Data = &w->ReadBuf[0];
+	} else {
+		Mapping = CreateFileMappingA(File, NULL, PAGE_READONLY, 0, 0, NULL);
+		Data = (Mapping != NULL) ? (const uint8_t *)MapViewOfFile(Mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+		if (Data == NULL){
+			if (Mapping != NULL) CloseHandle(Mapping);
+			CloseHandle(File);
+			return false;
+		}
+	}
+
+	Signal.Freq = Freq;
+	res = Signal.DecodeBlocks(Data, (int)FileSize.QuadPart);
+	if (Mapping != NULL){
+		UnmapViewOfFile(Data);
+		CloseHandle(Mapping);
+	}
+	CloseHandle(File);
+	w->FileCount ++;
+	w->ByteCount += FileSize.QuadPart;
+	if (!res) return false;
+
+	Signal.Normalise(MaxGap);
+	if (Signal.Durations.empty()) return false;
+	Signal.Write(OutputFormat, Results[task], Names[task].c_str());
+	return true;
+}
+
+bool IrBatch::Run(FILE * out){
+	SYSTEM_INFO SysInfo;
+	DWORD ThreadId;
+	int64_t StartTime;
+	std::string Header;
+	size_t i;
+	int Count = ThreadCount;
+
+	if (Count <= 0){
+		GetSystemInfo(&SysInfo);
+		Count = SysInfo.dwNumberOfProcessors;
+	}
+	if (Count <= 0) Count = 1;
+	if (Workers.empty()){
+		for (i = 0; i < (size_t)Count; i++){
+			Worker * w = new Worker;
+			w->Owner = this;
+			w->Index = (int)i;
+			w->Thread = NULL;
+			InitializeCriticalSection(&w->QueueCs);
+			w->ReadBuf.resize(ReadBufSize);
+			Workers.push_back(w);
+		}
+	}
+	for (i = 0; i < Workers.size(); i++){
+		Workers[i]->FileCount = 0;
+		Workers[i]->ByteCount = 0;
+		Workers[i]->StealCount = 0;
+		Workers[i]->Queue.clear();
+	}
+	//contiguous ranges keep files of one directory on one thread, queued in reverse so the back of each queue is its first file
+	for (i = 0; i < Files.size(); i++) Workers[(size_t)((uint64_t)i * Workers.size() / Files.size())]->Queue.push_front(i);
+	Results.assign(Files.size(), std::string());
+	FailCount = 0;
+
+	StartTime = TiqiaaUsbIr::GetTimeNs();
+	for (i = 0; i < Workers.size(); i++){
+		Workers[i]->Thread = CreateThread(0, 0, (LPTHREAD_START_ROUTINE)RunWorkerFn, Workers[i], 0, &ThreadId);
+		if (Workers[i]->Thread == NULL) WorkerFn(Workers[i]);
+	}
+	for (i = 0; i < Workers.size(); i++){
+		if (Workers[i]->Thread == NULL) continue;
+		WaitForSingleObject(Workers[i]->Thread, INFINITE);
+		CloseHandle(Workers[i]->Thread);
+		Workers[i]->Thread = NULL;
+	}
+	Elapsed = TiqiaaUsbIr::GetTimeNs() - StartTime;
+
+	if (OutputFormat == FormatLirc){
+		Header.clear();
+		IrSignal::WriteLircHeader(Header, "batch", Freq, MaxGap);
+		fwrite(Header.data(), 1, Header.size(), out);
+	}
+	for (i = 0; i < Results.size(); i++){
+		fwrite(Results[i].data(), 1, Results[i].size(), out);
+		if ((OutputFormat == FormatLirc) && !Results[i].empty()) fputs("\n", out);
+	}
+	if (OutputFormat == FormatLirc){
+		Header.clear();
+		IrSignal::WriteLircFooter(Header);
+		fwrite(Header.data(), 1, Header.size(), out);
+	}
+	return (ferror(out) == 0);
+}
+
+void IrBatch::WriteStats(FILE * f){
+	int64_t FileCount = 0;
+	int64_t Bytes = 0;
+	int64_t Steals = 0;
+	double Sec = Elapsed / 1000000000.0;
+	size_t i;
+
+	for (i = 0; i < Workers.size(); i++){
+		FileCount += Workers[i]->FileCount;
+		Bytes += Workers[i]->ByteCount;
+		Steals += Workers[i]->StealCount;
+	}
+	if (Sec <= 0) Sec = 1e-9;
+	fprintf(f, "INFO: %lld files (%lld failed), %.2f MB in %.3f s with %u threads: %.0f files/s, %.2f MB/s, %lld steals\n",
+		(long long)FileCount, (long long)FailCount, Bytes / 1000000.0, Sec, (unsigned)Workers.size(), FileCount / Sec, Bytes / 1000000.0 / Sec, (long long)Steals);
+	for (i = 0; i < Workers.size(); i++){
+		fprintf(f, "INFO:   thread %u: %lld files, %lld steals\n", (unsigned)i, (long long)Workers[i]->FileCount, (long long)Workers[i]->StealCount);
+	}
+}
@@ -0,0 +1,84 @@
+/*
+ * Multi-threaded conversion of signal capture archives
+ *
+ * Every *.bin file under given directories (as written by ir-usb -r) is decoded, normalised
+ * and converted to signal library entry, lircd.conf raw code, Pronto hex or Broadlink base64.
+ * Files are processed by a pool of threads, each thread owns a queue of files and steals
+ * from other queues when its own is empty.
+ */
+
+#ifndef IR_BATCH_H
+#define IR_BATCH_H
+
+#include "IrSignal.h"
+#include <windows.h>
+#include <stdio.h>
+#include <deque>
+
+class IrBatch {
+	public:
+	static const int FormatLibrary = IrSignal::FormatLibrary;
+	static const int FormatLirc = IrSignal::FormatLirc;
+	static const int FormatPronto = IrSignal::FormatPronto;
+	static const int FormatBroadlink = IrSignal::FormatBroadlink;
+
+	private:
+	static const int ReadBufSize = 65536; //larger files are memory-mapped
+
+	struct Worker{
+		IrBatch * Owner;
+		int Index;
+		HANDLE Thread;
+		CRITICAL_SECTION QueueCs;
+		std::deque<size_t> Queue;
+		std::vector<uint8_t> ReadBuf;
+		int64_t FileCount;
+		int64_t ByteCount;
+		int64_t StealCount;
+	};
+
+	std::vector<std::string> Files;
+	std::vector<std::string> Names;
+	std::vector<std::string> Results;
+	std::vector<Worker *> Workers;
+	volatile LONG FailCount;
+	int64_t Elapsed;
+
+	static DWORD WINAPI RunWorkerFn(Worker * w);
+	void WorkerFn(Worker * w);
+	bool NextTask(Worker * w, size_t * task);
+	bool ConvertFile(Worker * w, size_t task);
+	void AddFiles(const std::string &dir, const std::string &prefix);
+
+	public:
+	//! Output format, one of Format* constant
+	int OutputFormat;
+
+	//! Carrier freq assumed for captures, Hz
+	int Freq;
+
+	//! Max space duration after normalisation, usec
+	uint32_t MaxGap;
+
+	//! Number of threads, 0 - number of CPUs
+	int ThreadCount;
+
+	IrBatch();
+	virtual ~IrBatch();
+
+	//! Collect *.bin files from directory tree
+	//! path: Root directory
+	//! Return: number of files found
+	int AddDirectory(const char * path);
+
+	//! Convert collected files
+	//! out: Output file, entries are written in the order files were collected
+	//! Return: true - success, false - fail
+	bool Run(FILE * out);
+
+	//! Write throughput report
+	//! f: Output file
+	void WriteStats(FILE * f);
+};
+
+#endif
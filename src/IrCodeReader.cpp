@@ -0,0 +1,272 @@
+/*
+ * Streaming reader of IR code files
+ */
+
+#include "IrCodeReader.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+static bool TokenIs(const char * token, size_t len, const char * word){
+	return (strlen(word) == len) && (strncmp(token, word, len) == 0);
+}
+
+static bool IsProntoWord(const char * token, size_t len){
+	size_t i;
+
+	if (len != 4) return false;
+	for (i = 0; i < len; i++){
+		if (!isxdigit((unsigned char)token[i])) return false;
+	}
+	return true;
+}
+
+//split off first whitespace separated token, p is moved to the next one
+static const char * NextToken(const char * &p, size_t * len){
+	const char * Token;
+
+	while (isspace((unsigned char)*p)) p++;
+	Token = p;
+	while ((*p != 0) && !isspace((unsigned char)*p)) p++;
+	*len = p - Token;
+	while (isspace((unsigned char)*p)) p++;
+	return Token;
+}
+
+IrCodeReader::IrCodeReader(){
+	File = INVALID_HANDLE_VALUE;
+	Mapping = NULL;
+	MappedData = NULL;
+	Close();
+}
+
+IrCodeReader::~IrCodeReader(){
+	Close();
+}
+
+bool IrCodeReader::Open(const char * path, int format){
+	LARGE_INTEGER FileSize;
+
+	Close();
+	File = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (File == INVALID_HANDLE_VALUE) return false;
+	if (!GetFileSizeEx(File, &FileSize) || ((uint64_t)FileSize.QuadPart > (size_t)-1)){
+		Close();
+		return false;
+	}
+	if (FileSize.QuadPart == 0){
+		//empty file can't be mapped
+		OpenBuffer("", 0, format);
+		return true;
+	}
+	Mapping = CreateFileMappingA(File, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (Mapping != NULL) MappedData = (const char *)MapViewOfFile(Mapping, FILE_MAP_READ, 0, 0, 0);
+	if (MappedData == NULL){
+		Close();
+		return false;
+	}
+	OpenBuffer(MappedData, (size_t)FileSize.QuadPart, format);
+	return true;
+}
+
+void IrCodeReader::OpenBuffer(const char * data, size_t size, int format){
+	Data = data;
+	Size = size;
+	Pos = 0;
+	PendingName.clear();
+	InRawCodes = false;
+	LircSkip = false;
+	LircFreq = IrSignal::DefaultFreq;
+	LircName.clear();
+	LircCode.Durations.clear();
+	CodeCount = 0;
+	ErrorCount = 0;
+	Format = format;
+	if (Format == FormatAuto) Detect();
+}
+
+void IrCodeReader::Close(){
+	if (MappedData != NULL) UnmapViewOfFile(MappedData);
+	if (Mapping != NULL) CloseHandle(Mapping);
+	if (File != INVALID_HANDLE_VALUE) CloseHandle(File);
+	File = INVALID_HANDLE_VALUE;
+	Mapping = NULL;
+	MappedData = NULL;
+	Data = NULL;
+	Size = 0;
+	Pos = 0;
+	CodeCount = 0;
+	ErrorCount = 0;
+	Format = IrSignal::FormatLibrary;
+}
+
+bool IrCodeReader::NextLine(){
+	const char * LineEnd;
+	size_t Len;
+
+	if (Pos >= Size) return false;
+	LineEnd = (const char *)memchr(Data + Pos, '\n', Size - Pos);
+	Len = (LineEnd != NULL) ? (LineEnd - (Data + Pos)) : (Size - Pos);
+	Line.assign(Data + Pos, Len);
+	if (!Line.empty() && (Line[Line.size() - 1] == '\r')) Line.resize(Line.size() - 1);
+	Pos += Len + 1;
+	return true;
+}
+
+void IrCodeReader::Detect(){
+	const char * p;
+	const char * Token;
+	const char * Token2;
+	size_t Len, Len2;
+
+	Format = IrSignal::FormatLibrary;
+	while (NextLine()){
+		p = Line.c_str();
+		Token = NextToken(p, &Len);
+		if ((Len == 0) || (*Token == '#')) continue;
+		Token2 = NextToken(p, &Len2);
+		if (TokenIs(Token, Len, "begin")){
+			Format = IrSignal::FormatLirc;
+		} else if (IsProntoWord(Token, Len) || TokenIs(Token2, Len2, "0000")){
+			Format = IrSignal::FormatPronto;
+		} else if (((Len > 2) && (strncmp(Token, "Jg", 2) == 0)) || ((Len2 > 2) && (strncmp(Token2, "Jg", 2) == 0))){
+			//base64 of 0x26 (IR packet)
+			Format = IrSignal::FormatBroadlink;
+		}
+		break;
+	}
+	Pos = 0;
+}
+
+bool IrCodeReader::Next(IrSignal &signal, std::string &name){
+	const char * p;
+	const char * Token;
+	size_t Len;
+	bool NameFirst;
+	bool res;
+	char Buf[32];
+
+	if (Format == IrSignal::FormatLirc) return NextLirc(signal, name);
+	while (NextLine()){
+		p = Line.c_str();
+		while (isspace((unsigned char)*p)) p++;
+		if (*p == 0) continue;
+		if (*p == '#'){
+			//comment preceding Pronto or Broadlink code is its name
+			p++;
+			Token = NextToken(p, &Len);
+			PendingName.assign(Token, Len);
+			continue;
+		}
+		if (Format == IrSignal::FormatLibrary){
+			res = signal.ParseLibraryEntry(p, name);
+		} else {
+			Token = NextToken(p, &Len);
+			NameFirst = (Format == IrSignal::FormatPronto) ? !IsProntoWord(Token, Len) : (*p != 0);
+			if (NameFirst){
+				name.assign(Token, Len);
+			} else {
+				p = Token;
+				if (PendingName.empty()){
+					snprintf(Buf, sizeof(Buf), "code%d", CodeCount + ErrorCount + 1);
+					name = Buf;
+				} else name = PendingName;
+			}
+			res = (Format == IrSignal::FormatPronto) ? signal.ParsePronto(p) : signal.ParseBroadlink(p);
+		}
+		PendingName.clear();
+		if (res){
+			CodeCount ++;
+			return true;
+		}
+		ErrorCount ++;
+	}
+	return false;
+}
+
+bool IrCodeReader::TakeLircCode(IrSignal &signal, std::string &name){
+	char Buf[32];
+
+	if (LircCode.Durations.empty()) return false;
+	signal.Freq = LircFreq;
+	signal.Durations.swap(LircCode.Durations);
+	LircCode.Durations.clear();
+	if (LircName.empty()){
+		snprintf(Buf, sizeof(Buf), "code%d", CodeCount + ErrorCount + 1);
+		name = Buf;
+	} else name = LircName;
+	LircName.clear();
+	CodeCount ++;
+	return true;
+}
+
+bool IrCodeReader::NextLirc(IrSignal &signal, std::string &name){
+	const char * p;
+	const char * Token;
+	const char * Arg;
+	char * End;
+	size_t Len, ArgLen, Comment;
+	unsigned long Value;
+	bool res;
+
+	while (NextLine()){
+		Comment = Line.find('#');
+		if (Comment != std::string::npos) Line.resize(Comment);
+		p = Line.c_str();
+		Token = NextToken(p, &Len);
+		if (Len == 0) continue;
+		if (!InRawCodes){
+			Arg = NextToken(p, &ArgLen);
+			if (TokenIs(Token, Len, "begin") && TokenIs(Arg, ArgLen, "remote")){
+				LircFreq = IrSignal::DefaultFreq;
+			} else if (TokenIs(Token, Len, "frequency")){
+				Value = strtoul(Arg, NULL, 10);
+				if (Value > 0) LircFreq = (int)Value;
+			} else if (TokenIs(Token, Len, "begin") && TokenIs(Arg, ArgLen, "raw_codes")){
+				InRawCodes = true;
+				LircName.clear();
+				LircCode.Durations.clear();
+			}
+			continue;
+		}
+		if (TokenIs(Token, Len, "name") || TokenIs(Token, Len, "end")){
+			res = TakeLircCode(signal, name);
+			LircSkip = false;
+			if (TokenIs(Token, Len, "end")){
+				InRawCodes = false;
+			} else {
+				Arg = NextToken(p, &ArgLen);
+				LircName.assign(Arg, ArgLen);
+			}
+			if (res) return true;
+			continue;
+		}
+		if (LircSkip) continue;
+		for (p = Token; ; p = End){
+			Value = strtoul(p, &End, 10);
+			if (End == p) break;
+			LircCode.Durations.push_back((uint32_t)Value);
+		}
+		while (isspace((unsigned char)*p)) p++;
+		if (*p != 0){
+			//drop malformed code up to next name
+			ErrorCount ++;
+			LircCode.Durations.clear();
+			LircSkip = true;
+		}
+	}
+	return TakeLircCode(signal, name);
+}
+
+int IrCodeReader::GetCodeCount(){
+	return CodeCount;
+}
+
+int IrCodeReader::GetErrorCount(){
+	return ErrorCount;
+}
+
+size_t IrCodeReader::GetSize(){
+	return Size;
+}
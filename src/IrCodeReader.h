@@ -0,0 +1,97 @@
+/*
+ * Streaming reader of IR code files
+ *
+ * Supported formats (IrSignal::Format* constants):
+ *
+ * Library: "name freq mark space ..." per line
+ * Lirc: lircd.conf, codes of raw_codes sections
+ * Pronto: Pronto hex code per line, "name 0000 ..." or "0000 ..." preceded by "# name" line
+ * Broadlink: base64 IR packet per line, "name JgB..." or "JgB..." preceded by "# name" line
+ *
+ * File is memory-mapped and parsed in one pass, codes are returned one by one, so files with
+ * any number of codes can be converted without holding them in memory.
+ *
+ * Example:
+ *
+ * IrCodeReader Reader;
+ * IrSignal Signal;
+ * std::string Name;
+ * Reader.Open("codes.txt");
+ * while (Reader.Next(Signal, Name)) ...
+ */
+
+#ifndef IR_CODE_READER_H
+#define IR_CODE_READER_H
+
+#include "IrSignal.h"
+#include <windows.h>
+
+class IrCodeReader {
+	public:
+	static const int FormatAuto = -1;
+
+	private:
+	HANDLE File;
+	HANDLE Mapping;
+	const char * Data;
+	const char * MappedData;
+	size_t Size;
+	size_t Pos;
+	std::string Line;
+	std::string PendingName;
+
+	//lircd.conf state
+	bool InRawCodes;
+	bool LircSkip; //rest of malformed code is skipped
+	int LircFreq;
+	std::string LircName;
+	IrSignal LircCode;
+
+	int CodeCount;
+	int ErrorCount;
+
+	bool NextLine();
+	bool NextLirc(IrSignal &signal, std::string &name);
+	bool TakeLircCode(IrSignal &signal, std::string &name);
+	void Detect();
+
+	public:
+	//! Format of opened file, one of IrSignal::Format* constant
+	int Format;
+
+	IrCodeReader();
+	virtual ~IrCodeReader();
+
+	//! Open code file
+	//! path: Path to file
+	//! format: One of IrSignal::Format* constant, FormatAuto - detect by content
+	//! Return: true - success, false - fail
+	bool Open(const char * path, int format = FormatAuto);
+
+	//! Read codes from memory
+	//! data: File contents, should stay valid until Close
+	//! size: Size of data
+	//! format: One of IrSignal::Format* constant, FormatAuto - detect by content
+	void OpenBuffer(const char * data, size_t size, int format = FormatAuto);
+
+	//! Close file
+	void Close();
+
+	//! Read next code
+	//! signal: Output signal
+	//! name: Output code name, "codeN" for codes without name
+	//! Return: true - success, false - no more codes
+	//! Note: Malformed codes are skipped and counted by GetErrorCount
+	bool Next(IrSignal &signal, std::string &name);
+
+	//! Return: number of codes read
+	int GetCodeCount();
+
+	//! Return: number of skipped malformed codes
+	int GetErrorCount();
+
+	//! Return: size of file, bytes
+	size_t GetSize();
+};
+
+#endif
@@ -0,0 +1,254 @@
+/*
+ * Loopback latency and fidelity measurement with two devices
+ */
+
+#include "IrLoopback.h"
+#include "IrCodeReader.h"
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+
+IrLoopback::IrLoopback(){
+	RecvEvent = CreateEventA(NULL, FALSE, FALSE, NULL);
+	InitializeCriticalSection(&RecvCs);
+	RecvTime = 0;
+	RecvDone = false;
+	Repeats = 10;
+	RecvTimeout = 1000;
+	Interval = 50;
+}
+
+IrLoopback::~IrLoopback(){
+	CloseHandle(RecvEvent);
+	DeleteCriticalSection(&RecvCs);
+}
+
+void IrLoopback::StripLeadingSpace(IrSignal &signal){
+	//receiver reports time from arming to first mark as leading space
+	if ((signal.Durations.size() >= 2) && (signal.Durations[0] == 0)) signal.Durations.erase(signal.Durations.begin(), signal.Durations.begin() + 2);
+}
+
+bool IrLoopback::AddCode(const char * name, int freq, const uint8_t * data, int size){
+	IrLoopbackCode Code;
+
+	if ((size <= 0) || ((size + sizeof(TiqiaaUsbIr_SendIRPackHeader) + sizeof(uint16_t)) > TiqiaaUsbIr_MaxPacketSize)) return false;
+	if (!Code.Signal.DecodeBlocks(data, size)) return false;
+	StripLeadingSpace(Code.Signal);
+	if (Code.Signal.Durations.empty()) return false;
+	Code.Name = name;
+	Code.Freq = freq;
+	Code.Data.assign(data, data + size);
+	Code.Airtime = TiqiaaUsbIr::GetIrSignalDuration(data, size);
+	Code.Sent = 0;
+	Code.Received = 0;
+	Code.Empty = 0;
+	Code.EdgeMismatch = 0;
+	Codes.push_back(Code);
+	return true;
+}
+
+bool IrLoopback::AddCode(const char * name, const IrSignal &signal){
+	std::vector<uint8_t> Data;
+
+	signal.EncodeBlocks(Data);
+	if (Data.empty()) return false;
+	return AddCode(name, signal.Freq, &Data[0], (int)Data.size());
+}
+
+int IrLoopback::LoadCodes(const char * path){
+	std::vector<uint8_t> Data;
+	IrCodeReader Reader;
+	IrSignal Signal;
+	std::string Name;
+	const char * Ext;
+	int Count = 0;
+
+	Ext = strrchr(path, '.');
+	if ((Ext != NULL) && (_stricmp(Ext, ".bin") == 0)){
+		if (!TiqiaaUsbIr::ReadIrSignalFile(path, Data)) return -1;
+		return AddCode(path, IrSignal::DefaultFreq, &Data[0], (int)Data.size()) ? 1 : 0;
+	}
+	if (!Reader.Open(path)) return -1;
+	while (Reader.Next(Signal, Name)){
+		if (AddCode(Name.c_str(), Signal)) Count ++;
+	}
+	return Count;
+}
+
+void IrLoopback::AddDefaultCodes(){
+	static const uint16_t NecCodes[] = {0x10EF, 0x00FF, 0x807F, 0xFF00};
+	uint8_t Buf[128];
+	char Name[32];
+	int Size;
+	size_t i;
+
+	for (i = 0; i < sizeof(NecCodes) / sizeof(NecCodes[0]); i++){
+		Size = TiqiaaUsbIr::WriteIrNecSignal(NecCodes[i], Buf);
+		snprintf(Name, sizeof(Name), "nec:0x%04X", NecCodes[i]);
+		AddCode(Name, IrSignal::DefaultFreq, Buf, Size);
+	}
+}
+
+void IrLoopback::RecvCallback(uint8_t * data, int size, TiqiaaUsbIr * IrCls, void * context){
+	IrLoopback * Loopback = (IrLoopback *)context;
+	int64_t Time = TiqiaaUsbIr::GetTimeNs();
+
+	EnterCriticalSection(&Loopback->RecvCs);
+	Loopback->RecvData.assign(data, data + size);
+	Loopback->RecvTime = Time;
+	Loopback->RecvDone = true;
+	LeaveCriticalSection(&Loopback->RecvCs);
+	SetEvent(Loopback->RecvEvent);
+}
+
+void IrLoopback::Compare(IrLoopbackCode &code, const uint8_t * data, int size){
+	IrSignal Signal;
+	size_t Count;
+	size_t i;
+
+	if (!Signal.DecodeBlocks(data, size)) return;
+	StripLeadingSpace(Signal);
+	if (Signal.Durations.size() != code.Signal.Durations.size()) code.EdgeMismatch ++;
+	//trailing space ends with receiver timeout, not with an edge
+	Count = std::min(Signal.Durations.size(), code.Signal.Durations.size());
+	if ((Count > 0) && ((Count % 2) == 0)) Count --;
+	for (i = 0; i < Count; i++){
+		if ((i % 2) == 0) MarkErrors.push_back((int)Signal.Durations[i] - (int)code.Signal.Durations[i]);
+		else SpaceErrors.push_back((int)Signal.Durations[i] - (int)code.Signal.Durations[i]);
+	}
+}
+
+bool IrLoopback::Run(TiqiaaUsbIr &Tx, TiqiaaUsbIr &Rx){
+	TiqiaaUsbIr_IrRecvCallback * SavedCallback = Rx.IrRecvCallback;
+	void * SavedContext = Rx.IrRecvCbContext;
+	std::vector<uint8_t> Data;
+	int64_t SendTime;
+	int64_t Time;
+	bool Done;
+	bool res = true;
+	int r;
+	size_t i;
+
+	Latency.clear();
+	Overhead.clear();
+	MarkErrors.clear();
+	SpaceErrors.clear();
+	Rx.IrRecvCallback = RecvCallback;
+	Rx.IrRecvCbContext = this;
+	for (r = 0; (r < Repeats) && res; r++){
+		for (i = 0; i < Codes.size(); i++){
+			IrLoopbackCode &Code = Codes[i];
+
+			EnterCriticalSection(&RecvCs);
+			RecvDone = false;
+			LeaveCriticalSection(&RecvCs);
+			ResetEvent(RecvEvent);
+			if (!Rx.StartRecvIR()){
+				res = false;
+				break;
+			}
+			Sleep(RecvStartDelay);
+
+			SendTime = TiqiaaUsbIr::GetTimeNs();
+			if (!Tx.SendIR(Code.Freq, &Code.Data[0], (int)Code.Data.size())){
+				res = false;
+				break;
+			}
+			Code.Sent ++;
+			WaitForSingleObject(RecvEvent, RecvTimeout);
+
+			EnterCriticalSection(&RecvCs);
+			Done = RecvDone;
+			Time = RecvTime;
+			Data.swap(RecvData);
+			LeaveCriticalSection(&RecvCs);
+			if (Done && Data.empty()){
+				Code.Empty ++;
+			} else if (Done){
+				Code.Received ++;
+				Latency.push_back(Time - SendTime);
+				Overhead.push_back(Time - SendTime - Code.Airtime);
+				Compare(Code, &Data[0], (int)Data.size());
+			}
+			if (Interval > 0) Sleep(Interval);
+		}
+	}
+	Rx.SetIdleMode();
+	Rx.IrRecvCallback = SavedCallback;
+	Rx.IrRecvCbContext = SavedContext;
+	return res;
+}
+
+void IrLoopback::WriteErrorStats(FILE * f, const char * name, const std::vector<int> &errors){
+	std::vector<int> Sorted(errors);
+	std::vector<int> AbsErrors;
+	double Sum = 0;
+	double SumSq = 0;
+	double Mean;
+	size_t i;
+
+	if (Sorted.empty()){
+		fprintf(f, "# %s error us: none\n", name);
+		return;
+	}
+	std::sort(Sorted.begin(), Sorted.end());
+	for (i = 0; i < Sorted.size(); i++){
+		Sum += Sorted[i];
+		SumSq += (double)Sorted[i] * Sorted[i];
+		AbsErrors.push_back(abs(Sorted[i]));
+	}
+	std::sort(AbsErrors.begin(), AbsErrors.end());
+	Mean = Sum / Sorted.size();
+	fprintf(f, "# %s error us (%u edges): mean %.1f, stddev %.1f, p1 %d, p50 %d, p99 %d, min %d, max %d, abs p99 %d\n",
+		name, (unsigned)Sorted.size(), Mean, sqrt(std::max(0.0, SumSq / Sorted.size() - Mean * Mean)),
+		Sorted[Sorted.size() * 1 / 100], Sorted[Sorted.size() * 50 / 100], Sorted[Sorted.size() * 99 / 100],
+		Sorted.front(), Sorted.back(), AbsErrors[AbsErrors.size() * 99 / 100]);
+}
+
+void IrLoopback::GetErrorHist(const std::vector<int> &errors, int * hist){
+	int Bin;
+	size_t i;
+
+	memset(hist, 0, (2 * HistBins + 1) * sizeof(int));
+	for (i = 0; i < errors.size(); i++){
+		Bin = std::max(-HistBins, std::min((int)HistBins, (errors[i] + (errors[i] >= 0 ? HistStep / 2 : -HistStep / 2)) / HistStep));
+		hist[Bin + HistBins] ++;
+	}
+}
+
+void IrLoopback::WriteStats(FILE * f){
+	std::vector<int64_t> SortedLatency(Latency);
+	std::vector<int64_t> SortedOverhead(Overhead);
+	int MarkHist[2 * HistBins + 1];
+	int SpaceHist[2 * HistBins + 1];
+	int Sent = 0;
+	int Bin;
+	size_t i;
+
+	fprintf(f, "code,sent,received,empty,edge_mismatch,airtime_us\n");
+	for (i = 0; i < Codes.size(); i++){
+		IrLoopbackCode &Code = Codes[i];
+		fprintf(f, "%s,%d,%d,%d,%d,%.1f\n", Code.Name.c_str(), Code.Sent, Code.Received, Code.Empty, Code.EdgeMismatch, Code.Airtime / 1000.0);
+		Sent += Code.Sent;
+	}
+	fprintf(f, "# received %u/%d\n", (unsigned)Latency.size(), Sent);
+	if (Latency.empty()) return;
+	std::sort(SortedLatency.begin(), SortedLatency.end());
+	std::sort(SortedOverhead.begin(), SortedOverhead.end());
+	fprintf(f, "# latency ms: p50 %.3f, p90 %.3f, p99 %.3f, min %.3f, max %.3f\n",
+		SortedLatency[SortedLatency.size() * 50 / 100] / 1000000.0, SortedLatency[SortedLatency.size() * 90 / 100] / 1000000.0,
+		SortedLatency[SortedLatency.size() * 99 / 100] / 1000000.0, SortedLatency.front() / 1000000.0, SortedLatency.back() / 1000000.0);
+	fprintf(f, "# latency beyond airtime ms: p50 %.3f, p90 %.3f, p99 %.3f, min %.3f, max %.3f\n",
+		SortedOverhead[SortedOverhead.size() * 50 / 100] / 1000000.0, SortedOverhead[SortedOverhead.size() * 90 / 100] / 1000000.0,
+		SortedOverhead[SortedOverhead.size() * 99 / 100] / 1000000.0, SortedOverhead.front() / 1000000.0, SortedOverhead.back() / 1000000.0);
+	WriteErrorStats(f, "mark", MarkErrors);
+	WriteErrorStats(f, "space", SpaceErrors);
+
+	GetErrorHist(MarkErrors, MarkHist);
+	GetErrorHist(SpaceErrors, SpaceHist);
+	fprintf(f, "error_us,marks,spaces\n");
+	for (Bin = 0; Bin <= 2 * HistBins; Bin++){
+		if ((MarkHist[Bin] == 0) && (SpaceHist[Bin] == 0)) continue;
+		fprintf(f, "%s%d,%d,%d\n", (Bin == 0) ? "<=" : ((Bin == 2 * HistBins) ? ">=" : ""), (Bin - HistBins) * HistStep, MarkHist[Bin], SpaceHist[Bin]);
+	}
+}
@@ -0,0 +1,122 @@
+/*
+ * Loopback latency and fidelity measurement with two devices
+ *
+ * Transmitting device is pointed at receiving one. Each code is sent many times, receive
+ * callback arrival is timestamped against SendIR start and the received signal is compared
+ * edge by edge with the sent one.
+ *
+ * Example:
+ *
+ * IrLoopback Loopback;
+ * Loopback.AddDefaultCodes();
+ * Loopback.Repeats = 100;
+ * Loopback.Run(Tx, Rx);
+ * Loopback.WriteStats(stdout);
+ */
+
+#ifndef IR_LOOPBACK_H
+#define IR_LOOPBACK_H
+
+#include "TiqiaaUsb.h"
+#include "IrSignal.h"
+#include <stdio.h>
+
+struct IrLoopbackCode{
+	std::string Name;
+	int Freq;
+	std::vector<uint8_t> Data; //pre-encoded signal data
+	IrSignal Signal; //sent signal as it is encoded, with leading space dropped
+	int64_t Airtime; //nsec
+
+	int Sent;
+	int Received;
+	int Empty; //received reports without signal data, not compared
+	int EdgeMismatch; //received signals with different edge count
+};
+
+class IrLoopback {
+	public:
+	static const int HistStep = 16; //usec, width of error histogram bin
+	static const int HistBins = 32; //bins of each sign, errors beyond are counted by edge bins
+
+	private:
+	static const DWORD RecvStartDelay = 20; //msec, receiver arming time before transmit
+
+	HANDLE RecvEvent;
+	CRITICAL_SECTION RecvCs;
+	std::vector<uint8_t> RecvData;
+	int64_t RecvTime;
+	bool RecvDone;
+
+	static void RecvCallback(uint8_t * data, int size, TiqiaaUsbIr * IrCls, void * context);
+	static void StripLeadingSpace(IrSignal &signal);
+	void Compare(IrLoopbackCode &code, const uint8_t * data, int size);
+	static void WriteErrorStats(FILE * f, const char * name, const std::vector<int> &errors);
+
+	public:
+	//! Codes to send
+	std::vector<IrLoopbackCode> Codes;
+
+	//! Number of times each code is sent
+	int Repeats;
+
+	//! Max wait for received signal after transmit, msec
+	DWORD RecvTimeout;
+
+	//! Pause between transmits, msec
+	DWORD Interval;
+
+	//! Results of last Run: SendIR start to receive callback, nsec
+	std::vector<int64_t> Latency;
+
+	//! Results of last Run: latency - airtime, nsec
+	std::vector<int64_t> Overhead;
+
+	//! Results of last Run: received - sent duration of each compared mark, usec
+	std::vector<int> MarkErrors;
+
+	//! Results of last Run: received - sent duration of each compared space, usec
+	std::vector<int> SpaceErrors;
+
+	IrLoopback();
+	virtual ~IrLoopback();
+
+	//! Add code to send
+	//! name: Code name
+	//! freq: Carrier freq
+	//! data: IR signal data
+	//! size: Size of data
+	//! Return: true - success, false - empty or too long signal
+	bool AddCode(const char * name, int freq, const uint8_t * data, int size);
+
+	//! Add code to send
+	//! name: Code name
+	//! signal: Raw signal
+	//! Return: true - success, false - empty or too long signal
+	bool AddCode(const char * name, const IrSignal &signal);
+
+	//! Add codes from file
+	//! path: Signal data file (as written by ir-usb -r, *.bin) or code file of any IrCodeReader format
+	//! Return: number of codes added, -1 - unable to read file
+	int LoadCodes(const char * path);
+
+	//! Add a few NEC codes
+	void AddDefaultCodes();
+
+	//! Send all codes Repeats times
+	//! Tx: Opened transmitting device
+	//! Rx: Opened receiving device, its IrRecvCallback is replaced during run
+	//! Return: true - success, false - device fail
+	bool Run(TiqiaaUsbIr &Tx, TiqiaaUsbIr &Rx);
+
+	//! Build error histogram, first and last bins collect all errors beyond the range
+	//! errors: MarkErrors or SpaceErrors
+	//! hist: Output, 2 * HistBins + 1 bins, bin i is (i - HistBins) * HistStep usec
+	static void GetErrorHist(const std::vector<int> &errors, int * hist);
+
+	//! Write per-code results as CSV followed by latency and edge error summary
+	//! f: Output file
+	void WriteStats(FILE * f);
+};
+
+#endif
@@ -0,0 +1,308 @@
+/*
+ * Nearest-match lookup of raw IR signals in a large signal library
+ */
+
+#include "IrMatchIndex.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#define IR_MATCH_SSE2
+#include <emmintrin.h>
+#endif
+
+IrMatchIndex::IrMatchIndex(){
+	Tolerance = 25;
+	MinTolerance = 100;
+	Data = NULL;
+	Built = true;
+}
+
+IrMatchIndex::~IrMatchIndex(){
+}
+
+void IrMatchIndex::Clear(){
+	Names.clear();
+	Pending.clear();
+	PendingOffsets.clear();
+	PendingCounts.clear();
+	Groups.clear();
+	Fingerprints.clear();
+	EntryIndex.clear();
+	DataBuf.clear();
+	Data = NULL;
+	Built = true;
+}
+
+int IrMatchIndex::Prepare(const IrSignal &signal, uint16_t * out){
+	size_t First = 0;
+	size_t i;
+	int Count = 0;
+
+	//leading space is silence before the signal
+	if ((signal.Durations.size() >= 2) && (signal.Durations[0] == 0)) First = 2;
+	if ((signal.Durations.size() - First) > (size_t)MaxEdges) return 0;
+	for (i = First; i < signal.Durations.size(); i++){
+		out[Count++] = (uint16_t)((signal.Durations[i] < MaxDuration) ? signal.Durations[i] : (uint32_t)MaxDuration);
+	}
+	if ((Count % 2) != 0){
+		if (Count == MaxEdges) return 0;
+		out[Count++] = 0;
+	}
+	//trailing space depends on how capture ended, it doesn't identify signal
+	if (Count > 0) out[Count - 1] = 0;
+	return Count;
+}
+
+int IrMatchIndex::GetBin(uint32_t duration){
+	//bins: <256, <1024, <4096, >=4096 usec, wide enough for most edges to stay in one bin within tolerance
+	if (duration < 256) return 0;
+	if (duration < 1024) return 1;
+	if (duration < 4096) return 2;
+	return 3;
+}
+
+void IrMatchIndex::GetFingerprint(const uint16_t * durations, int count, uint8_t * fingerprint){
+	uint8_t * Bin;
+	int i;
+
+	memset(fingerprint, 0, FingerprintSize);
+	for (i = 0; i < count; i++){
+		Bin = fingerprint + (i * HistSegments / count) * HistBins + GetBin(durations[i]);
+		if (*Bin < 0xFF) (*Bin) ++;
+	}
+}
+
+bool IrMatchIndex::Add(const char * name, const IrSignal &signal){
+	uint16_t Buf[MaxEdges];
+	int Count = Prepare(signal, Buf);
+
+	if (Count == 0) return false;
+	Names.push_back(name);
+	PendingOffsets.push_back(Pending.size());
+	PendingCounts.push_back((uint16_t)Count);
+	Pending.insert(Pending.end(), Buf, Buf + Count);
+	Built = false;
+	return true;
+}
+
+int IrMatchIndex::LoadLibrary(const char * path){
+	FILE * f;
+	std::string Line;
+	std::string Name;
+	IrSignal Signal;
+	char Buf[4096];
+	size_t Len;
+	int Count = 0;
+
+	f = fopen(path, "rb");
+	if (f == NULL) return -1;
+	//lines may be longer than Buf
+	while (fgets(Buf, sizeof(Buf), f) != NULL){
+		Line += Buf;
+		Len = Line.size();
+		if ((Line[Len - 1] != '\n') && !feof(f)) continue;
+		if (Signal.ParseLibraryEntry(Line.c_str(), Name) && Add(Name.c_str(), Signal)) Count ++;
+		Line.clear();
+	}
+	fclose(f);
+	Build();
+	return Count;
+}
+
+void IrMatchIndex::Build(){
+	std::vector<uint32_t> Order;
+	size_t DataSize = 0;
+	size_t i;
+	size_t k;
+	uint32_t Entry;
+	int Count;
+
+	if (Built) return;
+	//old index data is merged with pending entries
+	if (!Groups.empty()){
+		for (i = 0; i < Groups.size(); i++){
+			for (k = 0; k < Groups[i].Count; k++){
+				Entry = EntryIndex[Groups[i].First + k];
+				PendingOffsets[Entry] = Pending.size();
+				Pending.insert(Pending.end(), Data + Groups[i].DataOffset + k * Groups[i].Stride, Data + Groups[i].DataOffset + k * Groups[i].Stride + PendingCounts[Entry]);
+			}
+		}
+	}
+
+	Order.resize(Names.size());
+	for (i = 0; i < Order.size(); i++) Order[i] = (uint32_t)i;
+	std::stable_sort(Order.begin(), Order.end(), [this](uint32_t a, uint32_t b){ return PendingCounts[a] < PendingCounts[b]; });
+
+	Groups.assign(MaxEdges / 2 + 1, Group());
+	for (i = 0; i < Groups.size(); i++){
+		Groups[i].First = 0;
+		Groups[i].Count = 0;
+		Groups[i].DataOffset = 0;
+		Groups[i].Stride = (int)(((i * 2) + EdgeAlign - 1) / EdgeAlign * EdgeAlign);
+	}
+	for (i = 0; i < Order.size(); i++){
+		Group &g = Groups[PendingCounts[Order[i]] / 2];
+		if (g.Count == 0){
+			g.First = i;
+			g.DataOffset = DataSize;
+		}
+		g.Count ++;
+		DataSize += g.Stride;
+	}
+
+	DataBuf.assign(DataSize * sizeof(uint16_t) + 16, 0);
+	Data = (uint16_t *)(((uintptr_t)&DataBuf[0] + 15) & ~(uintptr_t)15);
+	Fingerprints.resize(Order.size() * FingerprintSize);
+	EntryIndex = Order;
+	for (i = 0; i < Order.size(); i++){
+		Count = PendingCounts[Order[i]];
+		Group &g = Groups[Count / 2];
+		memcpy(Data + g.DataOffset + (i - g.First) * g.Stride, &Pending[PendingOffsets[Order[i]]], Count * sizeof(uint16_t));
+		GetFingerprint(&Pending[PendingOffsets[Order[i]]], Count, &Fingerprints[i * FingerprintSize]);
+	}
+	std::vector<uint16_t>().swap(Pending);
+	std::vector<size_t>().swap(PendingOffsets);
+	PendingOffsets.resize(Names.size());
+	Built = true;
+}
+
+size_t IrMatchIndex::GetCount(){
+	return Names.size();
+}
+
+size_t IrMatchIndex::GetMemorySize(){
+	return DataBuf.size() + Fingerprints.size() + EntryIndex.size() * sizeof(uint32_t) + PendingCounts.size() * sizeof(uint16_t);
+}
+
+const std::string &IrMatchIndex::GetName(int index){
+	return Names[index];
+}
+
+int IrMatchIndex::GetTolerance() const{
+	if (Tolerance < 0) return 0;
+	return (Tolerance > MaxTolerance) ? MaxTolerance : Tolerance;
+}
+
+int IrMatchIndex::GetMinTolerance() const{
+	if (MinTolerance < 0) return 0;
+	return (MinTolerance > (int)MaxDuration) ? (int)MaxDuration : MinTolerance;
+}
+
+void IrMatchIndex::Distance(const uint16_t * entry, const uint16_t * query, int stride, uint32_t * excess, uint32_t * error) const{
+	uint32_t Rel = (uint32_t)(GetTolerance() * 65536 / 100);
+	uint32_t MinTol = (uint32_t)GetMinTolerance();
+	int i;
+#ifdef IR_MATCH_SSE2
+	const __m128i RelV = _mm_set1_epi16((short)Rel);
+	const __m128i MinTolV = _mm_set1_epi16((short)MinTol);
+	const __m128i Ones = _mm_set1_epi16(1);
+	__m128i ExcessSum = _mm_setzero_si128();
+	__m128i ErrorSum = _mm_setzero_si128();
+	__m128i e, q, Diff, Tol;
+	uint32_t Sum[4];
+
+	for (i = 0; i < stride; i += EdgeAlign){
+		e = _mm_load_si128((const __m128i *)(entry + i));
+		q = _mm_load_si128((const __m128i *)(query + i));
+		Diff = _mm_or_si128(_mm_subs_epu16(e, q), _mm_subs_epu16(q, e));
+		//durations are <= 32767, so signed max is fine
+		Tol = _mm_max_epi16(_mm_mulhi_epu16(e, RelV), MinTolV);
+		ErrorSum = _mm_add_epi32(ErrorSum, _mm_madd_epi16(Diff, Ones));
+		ExcessSum = _mm_add_epi32(ExcessSum, _mm_madd_epi16(_mm_subs_epu16(Diff, Tol), Ones));
+	}
+	_mm_storeu_si128((__m128i *)Sum, ExcessSum);
+	*excess = Sum[0] + Sum[1] + Sum[2] + Sum[3];
+	_mm_storeu_si128((__m128i *)Sum, ErrorSum);
+	*error = Sum[0] + Sum[1] + Sum[2] + Sum[3];
+#else
+	uint32_t Diff, Tol;
+
+	*excess = 0;
+	*error = 0;
+	for (i = 0; i < stride; i++){
+		Diff = (entry[i] > query[i]) ? (entry[i] - query[i]) : (query[i] - entry[i]);
+		Tol = (entry[i] * Rel) >> 16;
+		if (Tol < MinTol) Tol = MinTol;
+		*error += Diff;
+		if (Diff > Tol) *excess += Diff - Tol;
+	}
+#endif
+}
+
+bool IrMatchIndex::Find(const IrSignal &signal, IrMatchResult * result) const{
+	alignas(16) uint16_t Query[MaxEdges];
+	alignas(16) uint8_t FingerprintMin[FingerprintSize];
+	alignas(16) uint8_t FingerprintMax[FingerprintSize];
+	uint32_t MinTol = (uint32_t)GetMinTolerance();
+	int Tol = GetTolerance();
+	uint32_t Lo, Hi, Excess, Error;
+	uint32_t BestExcess = 0xFFFFFFFF;
+	uint32_t BestError = 0xFFFFFFFF;
+	size_t Best = 0;
+	size_t i;
+	const uint8_t * Fp;
+	int Count, Segment, LoBin, HiBin, b;
+
+	result->Index = -1;
+	result->Candidates = 0;
+	if (!Built) return false;
+	Count = Prepare(signal, Query);
+	if ((Count == 0) || ((size_t)(Count / 2) >= Groups.size())) return false;
+	const Group &g = Groups[Count / 2];
+	if (g.Count == 0) return false;
+	memset(Query + Count, 0, (g.Stride - Count) * sizeof(uint16_t));
+
+	//bins an entry edge may fall into, if it's within tolerance of query edge
+	memset(FingerprintMin, 0, sizeof(FingerprintMin));
+	memset(FingerprintMax, 0, sizeof(FingerprintMax));
+	for (i = 0; i < (size_t)Count; i++){
+		Lo = Query[i] * 100 / (100 + Tol);
+		if (Query[i] <= MinTol) Lo = 0;
+		else if (Lo > Query[i] - MinTol) Lo = Query[i] - MinTol;
+		Hi = Query[i] * 100 / (100 - Tol) + 1;
+		if (Hi < Query[i] + MinTol) Hi = Query[i] + MinTol;
+		Segment = (int)(i * HistSegments / Count) * HistBins;
+		LoBin = GetBin(Lo);
+		HiBin = GetBin(Hi);
+		if ((LoBin == HiBin) && (FingerprintMin[Segment + LoBin] < 0xFF)) FingerprintMin[Segment + LoBin] ++;
+		for (b = LoBin; b <= HiBin; b++){
+			if (FingerprintMax[Segment + b] < 0xFF) FingerprintMax[Segment + b] ++;
+		}
+	}
+
+#ifdef IR_MATCH_SSE2
+	//whole fingerprint fits one register
+	const __m128i MinV = _mm_load_si128((const __m128i *)FingerprintMin);
+	const __m128i MaxV = _mm_load_si128((const __m128i *)FingerprintMax);
+	const __m128i Zero = _mm_setzero_si128();
+	__m128i f;
+#endif
+	Fp = &Fingerprints[g.First * FingerprintSize];
+	for (i = 0; i < g.Count; i++, Fp += FingerprintSize){
+#ifdef IR_MATCH_SSE2
+		f = _mm_loadu_si128((const __m128i *)Fp);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_or_si128(_mm_subs_epu8(MinV, f), _mm_subs_epu8(f, MaxV)), Zero)) != 0xFFFF) continue;
+#else
+		for (b = 0; b < FingerprintSize; b++){
+			if ((Fp[b] < FingerprintMin[b]) || (Fp[b] > FingerprintMax[b])) break;
+		}
+		if (b < FingerprintSize) continue;
+#endif
+		result->Candidates ++;
+		Distance(Data + g.DataOffset + i * g.Stride, Query, g.Stride, &Excess, &Error);
+		if ((Excess < BestExcess) || ((Excess == BestExcess) && (Error < BestError))){
+			BestExcess = Excess;
+			BestError = Error;
+			Best = i;
+		}
+	}
+	if (result->Candidates == 0) return false;
+
+	result->Index = (int)EntryIndex[g.First + Best];
+	result->InTolerance = (BestExcess == 0);
+	result->Excess = BestExcess;
+	result->MeanError = BestError / Count;
+	return true;
+}
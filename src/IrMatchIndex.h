@@ -0,0 +1,114 @@
+/*
+ * Nearest-match lookup of raw IR signals in a large signal library
+ *
+ * Entries are grouped by edge count. Within a group each entry has a fingerprint: histograms
+ * of its durations over logarithmic bins, one per quarter of the signal. A query computes, for
+ * every bin, how many of its edges must and how many may fall into that bin given the tolerance,
+ * and only entries whose histograms fit between those bounds are compared edge by edge. Durations of a group are stored as
+ * aligned fixed-stride uint16_t arrays, so the distance kernel runs on 8 edges at once.
+ *
+ * Example:
+ *
+ * IrMatchIndex Index;
+ * Index.LoadLibrary("remotes.txt");
+ * IrSignal Signal;
+ * Signal.DecodeBlocks(data, size);
+ * IrMatchResult Match;
+ * if (Index.Find(Signal, &Match)) printf("%s\n", Index.GetName(Match.Index).c_str());
+ */
+
+#ifndef IR_MATCH_INDEX_H
+#define IR_MATCH_INDEX_H
+
+#include "IrSignal.h"
+
+struct IrMatchResult{
+	int Index; //entry index in order of adding
+	bool InTolerance; //all edges are within tolerance
+	uint32_t Excess; //sum of edge errors beyond tolerance, usec
+	uint32_t MeanError; //mean edge error, usec
+	int Candidates; //entries compared edge by edge
+};
+
+class IrMatchIndex {
+	public:
+	static const int MaxEdges = 1024;
+	static const uint32_t MaxDuration = 32767; //usec, longer spaces are clamped
+	static const int HistBins = 4;
+	static const int HistSegments = 4;
+	static const int FingerprintSize = HistBins * HistSegments;
+	static const int MaxTolerance = 90; //percent, keeps relative tolerance multiplier of distance kernel within 16 bits
+
+	private:
+	static const int EdgeAlign = 8; //edges per distance kernel step
+
+	struct Group{
+		size_t First; //first sorted entry
+		size_t Count;
+		size_t DataOffset; //offset of first entry durations in Data
+		int Stride; //edge count rounded up to EdgeAlign
+	};
+
+	std::vector<std::string> Names;
+	std::vector<uint16_t> Pending; //durations of added entries, Build moves them to Data
+	std::vector<size_t> PendingOffsets;
+	std::vector<uint16_t> PendingCounts;
+
+	std::vector<Group> Groups; //indexed by edge count / 2
+	std::vector<uint8_t> Fingerprints; //FingerprintSize bytes per sorted entry, one byte per bin
+	std::vector<uint32_t> EntryIndex; //sorted entry -> entry index
+	std::vector<uint8_t> DataBuf;
+	uint16_t * Data; //DataBuf aligned to 16 bytes
+	bool Built;
+
+	static int Prepare(const IrSignal &signal, uint16_t * out);
+	static int GetBin(uint32_t duration);
+	static void GetFingerprint(const uint16_t * durations, int count, uint8_t * fingerprint);
+	int GetTolerance() const;
+	int GetMinTolerance() const;
+	void Distance(const uint16_t * entry, const uint16_t * query, int stride, uint32_t * excess, uint32_t * error) const;
+
+	public:
+	//! Relative edge tolerance, percent (0..MaxTolerance), values out of range are clamped
+	int Tolerance;
+
+	//! Min edge tolerance, usec (0..MaxDuration), values out of range are clamped
+	int MinTolerance;
+
+	IrMatchIndex();
+	virtual ~IrMatchIndex();
+
+	//! Remove all entries
+	void Clear();
+
+	//! Add entry, Build should be called before next Find
+	//! name: Signal name
+	//! signal: Signal, leading space is dropped and trailing space is ignored
+	//! Return: true - success, false - signal is empty or longer than MaxEdges
+	bool Add(const char * name, const IrSignal &signal);
+
+	//! Add all entries of signal library file and build the index
+	//! path: Path to library file
+	//! Return: number of entries added, -1 - unable to read file
+	int LoadLibrary(const char * path);
+
+	//! Build index from added entries
+	void Build();
+
+	//! Return: number of entries
+	size_t GetCount();
+
+	//! Return: size of index data, bytes
+	size_t GetMemorySize();
+
+	//! Return: name of entry
+	const std::string &GetName(int index);
+
+	//! Find nearest entry with the same number of edges, safe to call from several threads
+	//! signal: Signal to look up
+	//! result: Output match
+	//! Return: true - match found, false - no entry may be within tolerance
+	bool Find(const IrSignal &signal, IrMatchResult * result) const;
+};
+
+#endif
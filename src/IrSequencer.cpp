@@ -0,0 +1,224 @@
+/*
+ * Deadline-scheduled playback of IR transmit timelines
+ */
+
+#include "IrSequencer.h"
+#include <stdlib.h>
+#include <algorithm>
+
+static bool EventOffsetLess(const IrSequencerEvent &a, const IrSequencerEvent &b){
+	return a.Offset < b.Offset;
+}
+
+IrSequencer::IrSequencer(){
+	Timer = CreateWaitableTimerExA(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+	if (Timer == NULL) Timer = CreateWaitableTimerA(NULL, FALSE, NULL); //high resolution timer requires Windows 10 1803
+	ReplyMisses = 0;
+}
+
+IrSequencer::~IrSequencer(){
+	if (Timer != NULL) CloseHandle(Timer);
+}
+
+bool IrSequencer::Load(const char * path){
+	char Line[512];
+	char SignalStr[MAX_PATH];
+	double OffsetMs;
+	int Device;
+	int Freq;
+	int LineNum = 0;
+	int n;
+	uint8_t NecBuf[128];
+	unsigned long NecCode;
+	char * End;
+	FILE * f;
+
+	Events.clear();
+	f = fopen(path, "rt");
+	if (f == NULL){
+		fprintf(stderr, "ERROR: Unable to open timeline %s\n", path);
+		return false;
+	}
+	while (fgets(Line, sizeof(Line), f) != NULL){
+		LineNum ++;
+		if (Line[strspn(Line, " \t")] == '#') continue;
+		Freq = DefaultFreq;
+		n = sscanf(Line, "%lf %d %259s %d", &OffsetMs, &Device, SignalStr, &Freq);
+		if (n <= 0) continue; //empty line
+		if ((n < 3) || (OffsetMs < 0) || (Device < 0)){
+			fprintf(stderr, "ERROR: %s:%d: Invalid event\n", path, LineNum);
+			fclose(f);
+			return false;
+		}
+
+		IrSequencerEvent Ev;
+		Ev.Offset = (int64_t)(OffsetMs * 1000000);
+		Ev.Device = Device;
+		Ev.Freq = Freq;
+		Ev.Signal = SignalStr;
+		Ev.Line = LineNum;
+		Ev.Sent = false;
+		Ev.Replied = false;
+		Ev.Lateness = 0;
+		Ev.UsbLatency = 0;
+		Ev.IrLatency = 0;
+		Ev.IrStartLatency = 0;
+		if (strncmp(SignalStr, "nec:", 4) == 0){
+			NecCode = strtoul(SignalStr + 4, &End, 0);
+			if ((End == SignalStr + 4) || (*End != 0) || (NecCode > 0xFFFF)){
+				fprintf(stderr, "ERROR: %s:%d: Invalid NEC code %s\n", path, LineNum, SignalStr + 4);
+				fclose(f);
+				return false;
+			}
+			n = TiqiaaUsbIr::WriteIrNecSignal((uint16_t)NecCode, NecBuf);
+			Ev.Data.assign(NecBuf, NecBuf + n);
+		} else if (!TiqiaaUsbIr::ReadIrSignalFile(SignalStr, Ev.Data)){
+			fprintf(stderr, "ERROR: %s:%d: Unable to read signal %s\n", path, LineNum, SignalStr);
+			fclose(f);
+			return false;
+		}
+		Ev.Airtime = TiqiaaUsbIr::GetIrSignalDuration(&Ev.Data[0], (int)Ev.Data.size());
+		Events.push_back(Ev);
+	}
+	fclose(f);
+	std::stable_sort(Events.begin(), Events.end(), EventOffsetLess);
+	return true;
+}
+
+void IrSequencer::SleepUntil(int64_t time){
+	LARGE_INTEGER DueTime;
+	int64_t Now;
+
+	Now = TiqiaaUsbIr::GetTimeNs();
+	if ((Timer != NULL) && ((time - Now) > SpinTime)){
+		DueTime.QuadPart = -((time - Now - SpinTime) / 100);
+		if (SetWaitableTimer(Timer, &DueTime, 0, NULL, NULL, FALSE)) WaitForSingleObject(Timer, INFINITE);
+	}
+	while (TiqiaaUsbIr::GetTimeNs() < time);
+}
+
+bool IrSequencer::Run(std::vector<TiqiaaUsbIr *> &Devices){
+	std::vector<int> PendingEvent(Devices.size(), -1);
+	std::vector<int64_t> UsbLatency(Devices.size(), 0);
+	std::vector<int64_t> IrStartLatency(Devices.size(), 0);
+	std::vector<int64_t> WriteEnd(Devices.size(), 0);
+	int64_t Start;
+	int64_t Deadline;
+	int64_t WriteStart;
+	int64_t SendTime;
+	int64_t NextSend;
+	int64_t WaitTime;
+	int64_t Sample;
+	uint8_t CmdId;
+	size_t i;
+	size_t d;
+	bool res = true;
+
+	ReplyMisses = 0;
+	for (i = 0; i < Events.size(); i++){
+		if ((size_t)Events[i].Device >= Devices.size()){
+			fprintf(stderr, "ERROR: Timeline line %d: No device %d\n", Events[i].Line, Events[i].Device);
+			return false;
+		}
+	}
+	for (d = 0; d < Devices.size(); d++){
+		if (!Devices[d]->SetSendMode()) return false;
+	}
+
+	Start = TiqiaaUsbIr::GetTimeNs() + StartDelay;
+	for (i = 0; i < Events.size(); i++){
+		IrSequencerEvent &Ev = Events[i];
+		TiqiaaUsbIr * Dev = Devices[Ev.Device];
+		d = Ev.Device;
+		Deadline = Start + Ev.Offset;
+		SendTime = Deadline - UsbLatency[d] - IrStartLatency[d];
+
+		//device can't take next signal until previous one is transmitted, but lost reply must not delay the timeline:
+		//wait until send time of this event or end of previous airtime, whichever is later
+		if (PendingEvent[d] >= 0){
+			WaitTime = std::max(SendTime - SpinTime, WriteEnd[d] + Events[PendingEvent[d]].Airtime) - TiqiaaUsbIr::GetTimeNs();
+			if (WaitTime < 0) WaitTime = 0;
+			if (WaitTime > (int64_t)ReplyWaitTimeout * 1000000) WaitTime = (int64_t)ReplyWaitTimeout * 1000000;
+			if (Dev->WaitCmdReply((DWORD)(WaitTime / 1000000))){
+				Events[PendingEvent[d]].Replied = true;
+				Events[PendingEvent[d]].IrLatency = TiqiaaUsbIr::GetTimeNs() - WriteEnd[d];
+			} else {
+				Dev->CancelCmdReplyWaiting();
+				ReplyMisses ++;
+			}
+			PendingEvent[d] = -1;
+		}
+
+		SleepUntil(SendTime);
+		CmdId = Dev->GetCmdId();
+		if (!Dev->StartCmdReplyWaiting(TiqiaaUsbIr::CmdOutput, CmdId)){
+			res = false;
+			continue;
+		}
+		WriteStart = TiqiaaUsbIr::GetTimeNs();
+		Ev.Sent = Dev->SendIRCmd(Ev.Freq, &Ev.Data[0], (int)Ev.Data.size(), CmdId);
+		WriteEnd[d] = TiqiaaUsbIr::GetTimeNs();
+		if (!Ev.Sent){
+			Dev->CancelCmdReplyWaiting();
+			res = false;
+			continue;
+		}
+		Ev.UsbLatency = WriteEnd[d] - WriteStart;
+		Ev.IrStartLatency = IrStartLatency[d];
+		Ev.Lateness = WriteEnd[d] + IrStartLatency[d] - Deadline;
+		if (UsbLatency[d] == 0) UsbLatency[d] = Ev.UsbLatency; else UsbLatency[d] += (Ev.UsbLatency - UsbLatency[d]) / 4;
+		PendingEvent[d] = (int)i;
+
+		//collect reply while waiting for next event, to measure IR latency precisely
+		if ((i + 1) < Events.size()){
+			NextSend = Start + Events[i + 1].Offset - UsbLatency[Events[i + 1].Device] - IrStartLatency[Events[i + 1].Device];
+			WaitTime = NextSend - TiqiaaUsbIr::GetTimeNs() - SpinTime;
+			if (WaitTime > 1000000){
+				if (WaitTime > (int64_t)ReplyWaitTimeout * 1000000) WaitTime = (int64_t)ReplyWaitTimeout * 1000000;
+				if (Dev->WaitCmdReply((DWORD)(WaitTime / 1000000))){
+					Ev.Replied = true;
+					Ev.IrLatency = TiqiaaUsbIr::GetTimeNs() - WriteEnd[d];
+					PendingEvent[d] = -1;
+					//only replies awaited right after the write are timed precisely enough to update the estimate
+					Sample = (Ev.IrLatency - Ev.Airtime) / 2;
+					if (Sample < 0) Sample = 0;
+					if (IrStartLatency[d] == 0) IrStartLatency[d] = Sample; else IrStartLatency[d] += (Sample - IrStartLatency[d]) / 4;
+				}
+			}
+		}
+	}
+	for (d = 0; d < Devices.size(); d++){
+		if (PendingEvent[d] < 0) continue;
+		if (Devices[d]->WaitCmdReply(ReplyWaitTimeout)){
+			Events[PendingEvent[d]].Replied = true;
+			Events[PendingEvent[d]].IrLatency = TiqiaaUsbIr::GetTimeNs() - WriteEnd[d];
+		} else {
+			Devices[d]->CancelCmdReplyWaiting();
+			ReplyMisses ++;
+		}
+	}
+	return res;
+}
+
+void IrSequencer::WriteStats(FILE * f){
+	std::vector<int64_t> Lateness;
+	double Sum = 0;
+	size_t i;
+
+	fprintf(f, "line,offset_ms,device,signal,sent,replied,lateness_us,usb_us,ir_us,ir_start_us\n");
+	for (i = 0; i < Events.size(); i++){
+		IrSequencerEvent &Ev = Events[i];
+		fprintf(f, "%d,%.3f,%d,%s,%d,%d,%.1f,%.1f,%.1f,%.1f\n", Ev.Line, Ev.Offset / 1000000.0, Ev.Device, Ev.Signal.c_str(),
+			Ev.Sent ? 1 : 0, Ev.Replied ? 1 : 0, Ev.Lateness / 1000.0, Ev.UsbLatency / 1000.0, Ev.IrLatency / 1000.0, Ev.IrStartLatency / 1000.0);
+		if (Ev.Sent){
+			Lateness.push_back(Ev.Lateness);
+			Sum += Ev.Lateness;
+		}
+	}
+	if (Lateness.empty()) return;
+	std::sort(Lateness.begin(), Lateness.end());
+	fprintf(f, "# sent %u/%u, reply misses %d, lateness us: mean %.1f, p50 %.1f, p95 %.1f, p99 %.1f, min %.1f, max %.1f\n",
+		(unsigned)Lateness.size(), (unsigned)Events.size(), ReplyMisses, Sum / Lateness.size() / 1000.0,
+		Lateness[Lateness.size() * 50 / 100] / 1000.0, Lateness[Lateness.size() * 95 / 100] / 1000.0,
+		Lateness[Lateness.size() * 99 / 100] / 1000.0, Lateness.front() / 1000.0, Lateness.back() / 1000.0);
+}
@@ -0,0 +1,81 @@
+/*
+ * Deadline-scheduled playback of IR transmit timelines
+ *
+ * Timeline file is a text file, one event per line:
+ *
+ * # offset_ms device signal [freq]
+ * 0     0  power.bin
+ * 350   0  nec:0x10EF
+ * 1200  1  input.bin 36000
+ *
+ * offset_ms: Event time from start of playback, msec
+ * device: Index of device in list passed to Run()
+ * signal: Path to signal file (as written by ir-usb -r) or nec:<code>
+ * freq: Carrier freq, 38000 by default
+ */
+
+#ifndef IR_SEQUENCER_H
+#define IR_SEQUENCER_H
+
+#include "TiqiaaUsb.h"
+#include <stdio.h>
+
+struct IrSequencerEvent{
+	int64_t Offset; //nsec from start of playback
+	int Device;
+	int Freq;
+	std::string Signal;
+	std::vector<uint8_t> Data; //pre-encoded signal data
+	int Line;
+
+	bool Sent;
+	bool Replied;
+	int64_t Airtime; //nsec
+	int64_t Lateness; //estimated IR start time - deadline, nsec
+	int64_t UsbLatency; //time of writing packet to device, nsec
+	int64_t IrLatency; //time from packet write to CmdOutput reply, nsec
+	int64_t IrStartLatency; //estimated time from packet write to IR start used for this event, nsec
+};
+
+class IrSequencer {
+	private:
+	static const int64_t StartDelay = 100000000; //nsec, time to settle before first event
+	static const int64_t SpinTime = 1000000; //nsec, busy wait before deadline
+	static const DWORD ReplyWaitTimeout = 2000;
+	static const int DefaultFreq = 38000;
+
+	HANDLE Timer;
+
+	void SleepUntil(int64_t time);
+
+	public:
+	//! Loaded events, sorted by offset
+	std::vector<IrSequencerEvent> Events;
+
+	//! Sent events whose reply was not received in time during last Run, they have Replied false
+	int ReplyMisses;
+
+	IrSequencer();
+	virtual ~IrSequencer();
+
+	//! Load timeline file and pre-encode all signals
+	//! path: Path to timeline file
+	//! Return: true - success, false - fail, error is printed to stderr
+	bool Load(const char * path);
+
+	//! Play loaded timeline
+	//! Devices: Opened devices, indexed by event device field
+	//! Return: true - all events were sent, false - fail
+	//! Note: Each event is written ahead of its deadline by measured USB write latency and estimated
+	//! write-to-IR-start latency of target device. Only the sum of IR start and reply latencies is
+	//! observable (IrLatency - Airtime), IR start is assumed to take half of it;
+	//! Reply for previous event is awaited only before next event to the same device, at most until
+	//! that event is due to be sent or previous signal airtime ends, missing reply is cancelled and counted
+	bool Run(std::vector<TiqiaaUsbIr *> &Devices);
+
+	//! Write per-event results as CSV followed by lateness summary
+	//! f: Output file
+	void WriteStats(FILE * f);
+};
+
+#endif
@@ -0,0 +1,325 @@
+/*
+ * IR signal in decoded form and its text representations
+ */
+
+#include "IrSignal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <string.h>
+
+static const double ProntoUnit = 0.241246; //usec, carrier period = freq word * ProntoUnit
+static const char Base64Chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static int Base64Value(char c){
+	if ((c >= 'A') && (c <= 'Z')) return c - 'A';
+	if ((c >= 'a') && (c <= 'z')) return c - 'a' + 26;
+	if ((c >= '0') && (c <= '9')) return c - '0' + 52;
+	if (c == '+') return 62;
+	if (c == '/') return 63;
+	return -1;
+}
+
+IrSignal::IrSignal(){
+	Freq = DefaultFreq;
+}
+
+bool IrSignal::DecodeBlocks(const uint8_t * data, int size){
+	bool IsMark;
+	bool LastIsMark = false;
+	uint32_t Ticks;
+	int i;
+
+	Durations.clear();
+	for (i = 0; i < size; i++){
+		IsMark = (data[i] & 0x80) != 0;
+		Ticks = data[i] & MaxBlockTicks;
+		if (Ticks == 0) continue;
+		if (Durations.empty()){
+			if (!IsMark) Durations.push_back(0); //keep mark/space parity
+			Durations.push_back(Ticks * TickSize);
+		} else if (IsMark == LastIsMark){
+			Durations.back() += Ticks * TickSize;
+		} else {
+			Durations.push_back(Ticks * TickSize);
+		}
+		LastIsMark = IsMark;
+	}
+	return !Durations.empty();
+}
+
+void IrSignal::EncodeBlocks(std::vector<uint8_t> &out) const{
+	uint64_t Total = 0; //usec
+	uint64_t Emitted = 0; //ticks
+	uint64_t Ticks;
+	uint8_t Level;
+	size_t i;
+
+	out.clear();
+	for (i = 0; i < Durations.size(); i++){
+		Total += Durations[i];
+		Ticks = (Total + TickSize / 2) / TickSize - Emitted;
+		Emitted += Ticks;
+		Level = ((i % 2) == 0) ? 0x80 : 0;
+		while (Ticks > 0){
+			out.push_back(Level | (uint8_t)((Ticks < (uint64_t)MaxBlockTicks) ? Ticks : MaxBlockTicks));
+			Ticks -= out.back() & MaxBlockTicks;
+		}
+	}
+}
+
+void IrSignal::Normalise(uint32_t MaxGap){
+	size_t i;
+
+	//leading space is silence before the signal
+	if ((Durations.size() >= 2) && (Durations[0] == 0)) Durations.erase(Durations.begin(), Durations.begin() + 2);
+	for (i = 1; i < Durations.size(); i += 2){
+		if (Durations[i] > MaxGap) Durations[i] = MaxGap;
+	}
+	if ((Durations.size() % 2) != 0) Durations.push_back((MaxGap > (uint32_t)DefaultTrailingGap) ? (uint32_t)DefaultTrailingGap : MaxGap);
+}
+
+bool IrSignal::ParseLibraryEntry(const char * line, std::string &name){
+	const char * p = line;
+	char * End;
+	unsigned long Value;
+
+	Durations.clear();
+	while (isspace((unsigned char)*p)) p++;
+	if ((*p == 0) || (*p == '#')) return false;
+	name.clear();
+	while ((*p != 0) && !isspace((unsigned char)*p)) name += *p++;
+	Freq = (int)strtoul(p, &End, 10);
+	if ((End == p) || (Freq <= 0)) return false;
+	for (p = End; ; p = End){
+		Value = strtoul(p, &End, 10);
+		if (End == p) break;
+		Durations.push_back((uint32_t)Value);
+	}
+	while (isspace((unsigned char)*p)) p++;
+	return (*p == 0) && !Durations.empty();
+}
+
+bool IrSignal::ParsePronto(const char * text){
+	const char * p = text;
+	char * End;
+	unsigned long Word[4];
+	unsigned long Cycles;
+	unsigned long Count, i;
+	double Period;
+	double Total = 0; //usec
+	uint32_t Emitted = 0; //usec
+
+	Durations.clear();
+	for (i = 0; i < 4; i++){
+		Word[i] = strtoul(p, &End, 16);
+		if ((End == p) || (Word[i] > 0xFFFF)) return false;
+		p = End;
+	}
+	if ((Word[0] != 0) || (Word[1] == 0) || ((Word[2] + Word[3]) == 0)) return false;
+	Period = Word[1] * ProntoUnit;
+	Freq = (int)(1000000 / Period + 0.5);
+	//repeat sequence follows once sequence
+	Count = ((Word[2] != 0) ? Word[2] : Word[3]) * 2;
+	for (i = 0; i < (Word[2] + Word[3]) * 2; i++){
+		Cycles = strtoul(p, &End, 16);
+		if ((End == p) || (Cycles > 0xFFFF)) return false;
+		p = End;
+		if (i >= Count) continue;
+		Total += Cycles * Period;
+		Durations.push_back((uint32_t)(Total + 0.5) - Emitted);
+		Emitted += Durations.back();
+	}
+	while (isspace((unsigned char)*p)) p++;
+	return (*p == 0);
+}
+
+bool IrSignal::ParseBroadlink(const char * text){
+	std::vector<uint8_t> Packet;
+	const char * p = text;
+	uint32_t Bits = 0;
+	int BitCount = 0;
+	int Value;
+	size_t Size, i;
+	uint64_t TotalTicks = 0;
+	uint64_t Emitted = 0; //usec
+	uint64_t Total;
+
+	Durations.clear();
+	while (isspace((unsigned char)*p)) p++;
+	for (; (*p != 0) && (*p != '=') && !isspace((unsigned char)*p); p++){
+		Value = Base64Value(*p);
+		if (Value < 0) return false;
+		Bits = (Bits << 6) | Value;
+		BitCount += 6;
+		if (BitCount >= 8){
+			BitCount -= 8;
+			Packet.push_back((uint8_t)(Bits >> BitCount));
+		}
+	}
+	while (*p == '=') p++;
+	while (isspace((unsigned char)*p)) p++;
+	if (*p != 0) return false;
+
+	//0x26 - IR, repeat count, uint16_t LE size, durations in ticks, 0 + uint16_t BE for long ones
+	if ((Packet.size() < 4) || (Packet[0] != 0x26)) return false;
+	Size = Packet[2] | (Packet[3] << 8);
+	if ((Size + 4) > Packet.size()) return false;
+	Freq = DefaultFreq;
+	for (i = 4; i < (Size + 4); i++){
+		Value = Packet[i];
+		if (Value == 0){
+			if ((i + 2) >= (Size + 4)) return false;
+			Value = (Packet[i + 1] << 8) | Packet[i + 2];
+			i += 2;
+		}
+		TotalTicks += Value;
+		Total = (TotalTicks * BroadlinkTickDen + BroadlinkTickNum / 2) / BroadlinkTickNum;
+		Durations.push_back((uint32_t)(Total - Emitted));
+		Emitted = Total;
+	}
+	return !Durations.empty();
+}
+
+void IrSignal::WriteLibraryEntry(std::string &out, const char * name) const{
+	char Buf[16];
+	size_t i;
+
+	out += name;
+	snprintf(Buf, sizeof(Buf), " %d", Freq);
+	out += Buf;
+	for (i = 0; i < Durations.size(); i++){
+		snprintf(Buf, sizeof(Buf), " %u", Durations[i]);
+		out += Buf;
+	}
+	out += '\n';
+}
+
+void IrSignal::WriteLircRaw(std::string &out, const char * name) const{
+	char Buf[32];
+	size_t Count;
+	size_t i;
+
+	//lirc raw code ends with pulse
+	if (Durations.empty()) return;
+	Count = Durations.size();
+	if ((Count % 2) == 0) Count --;
+	out += "          name ";
+	out += name;
+	out += '\n';
+	for (i = 0; i < Count; i++){
+		snprintf(Buf, sizeof(Buf), (i % 8) == 0 ? "          %7u" : " %7u", Durations[i]);
+		out += Buf;
+		if (((i % 8) == 7) || ((i + 1) == Count)) out += '\n';
+	}
+}
+
+void IrSignal::WritePronto(std::string &out) const{
+	char Buf[32];
+	double Period;
+	double Total = 0; //carrier cycles
+	uint64_t Emitted = 0; //carrier cycles
+	uint32_t Cycles;
+	unsigned Word;
+	size_t Pairs;
+	size_t i;
+
+	Word = (unsigned)(1000000 / (Freq * ProntoUnit) + 0.5);
+	if (Word == 0) Word = 1;
+	if (Word > 0xFFFF) Word = 0xFFFF;
+	Period = Word * ProntoUnit;
+	//pronto holds mark/space pairs, signal ending with mark (as lirc raw code) gets trailing gap
+	Pairs = (Durations.size() + 1) / 2;
+	snprintf(Buf, sizeof(Buf), "0000 %04X %04X 0000", Word, (unsigned)Pairs);
+	out += Buf;
+	for (i = 0; i < 2 * Pairs; i++){
+		Total += ((i < Durations.size()) ? Durations[i] : (uint32_t)DefaultTrailingGap) / Period;
+		Cycles = (uint32_t)((uint64_t)(Total + 0.5) - Emitted);
+		if (Cycles == 0) Cycles = 1;
+		if (Cycles > 0xFFFF) Cycles = 0xFFFF;
+		Emitted += Cycles;
+		snprintf(Buf, sizeof(Buf), " %04X", Cycles);
+		out += Buf;
+	}
+	out += '\n';
+}
+
+void IrSignal::WriteBroadlink(std::string &out) const{
+	std::vector<uint8_t> Packet(4, 0);
+	uint64_t Total = 0; //usec
+	uint64_t Emitted = 0; //ticks
+	uint32_t Ticks;
+	uint32_t Bits;
+	size_t i, k;
+
+	for (i = 0; i < Durations.size(); i++){
+		Total += Durations[i];
+		Ticks = (uint32_t)((Total * BroadlinkTickNum + BroadlinkTickDen / 2) / BroadlinkTickDen - Emitted);
+		if (Ticks == 0) Ticks = 1; //0 is escape for long durations
+		if (Ticks > 0xFFFF) Ticks = 0xFFFF;
+		Emitted += Ticks;
+		if (Ticks < 256){
+			Packet.push_back((uint8_t)Ticks);
+		} else {
+			Packet.push_back(0);
+			Packet.push_back((uint8_t)(Ticks >> 8));
+			Packet.push_back((uint8_t)Ticks);
+		}
+	}
+	Packet[0] = 0x26;
+	Packet[1] = 0;
+	Packet[2] = (uint8_t)(Packet.size() - 4);
+	Packet[3] = (uint8_t)((Packet.size() - 4) >> 8);
+	Packet.push_back(0x0D);
+	Packet.push_back(0x05);
+	//device expects packet padded to 16 bytes including its 4 byte command header
+	while (((Packet.size() + 4) % 16) != 0) Packet.push_back(0);
+
+	for (i = 0; i < Packet.size(); i += 3){
+		Bits = Packet[i] << 16;
+		if ((i + 1) < Packet.size()) Bits |= Packet[i + 1] << 8;
+		if ((i + 2) < Packet.size()) Bits |= Packet[i + 2];
+		for (k = 0; k < 4; k++){
+			out += ((i + k) <= Packet.size()) ? Base64Chars[(Bits >> (18 - k * 6)) & 0x3F] : '=';
+		}
+	}
+	out += '\n';
+}
+
+void IrSignal::Write(int format, std::string &out, const char * name) const{
+	switch (format){
+		case FormatLirc:
+			WriteLircRaw(out, name);
+			break;
+		case FormatPronto:
+			out += "# ";
+			out += name;
+			out += '\n';
+			WritePronto(out);
+			break;
+		case FormatBroadlink:
+			out += "# ";
+			out += name;
+			out += '\n';
+			WriteBroadlink(out);
+			break;
+		default:
+			WriteLibraryEntry(out, name);
+			break;
+	}
+}
+
+void IrSignal::WriteLircHeader(std::string &out, const char * name, int freq, uint32_t gap){
+	char Buf[64];
+
+	out += "begin remote\n\n  name  ";
+	out += name;
+	out += "\n  flags RAW_CODES\n  eps   30\n  aeps  100\n";
+	snprintf(Buf, sizeof(Buf), "  frequency %d\n  gap   %u\n\n", freq, gap);
+	out += Buf;
+	out += "      begin raw_codes\n\n";
+}
+
+void IrSignal::WriteLircFooter(std::string &out){
+	out += "      end raw_codes\n\nend remote\n";
+}
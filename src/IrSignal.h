@@ -0,0 +1,115 @@
+/*
+ * IR signal in decoded form and its text representations
+ *
+ * Supported representations: Tiqiaa signal data (16 usec ticks), signal library, lircd.conf
+ * raw_codes, Pronto hex (learned, 0000 type) and Broadlink IR packet in base64.
+ * Timings are resampled with error carry: each edge is rounded at its absolute position,
+ * so rounding errors don't accumulate over the signal.
+ *
+ * Signal library is a text file, one signal per line:
+ *
+ * name freq mark space mark ...
+ *
+ * name: Signal name without spaces
+ * freq: Carrier freq, Hz
+ * mark, space: Alternating durations, usec, starting with mark
+ */
+
+#ifndef IR_SIGNAL_H
+#define IR_SIGNAL_H
+
+#include <stdint.h>
+#include <vector>
+#include <string>
+
+class IrSignal {
+	public:
+	static const int FormatLibrary = 0;
+	static const int FormatLirc = 1;
+	static const int FormatPronto = 2;
+	static const int FormatBroadlink = 3;
+
+	static const int TickSize = 16; //usec, one tick of Tiqiaa signal data
+	static const int MaxBlockTicks = 127;
+	static const int DefaultFreq = 38000;
+	static const uint32_t DefaultMaxGap = 100000; //usec
+	static const uint32_t DefaultTrailingGap = 20000; //usec, appended to signals ending with mark
+	static const int BroadlinkTickNum = 269; //Broadlink tick = 8192 / 269 usec
+	static const int BroadlinkTickDen = 8192;
+
+	//! Carrier freq, Hz
+	int Freq;
+
+	//! Alternating mark/space durations, usec, starting with mark
+	std::vector<uint32_t> Durations;
+
+	IrSignal();
+
+	//! Decode Tiqiaa signal data (as sent by SendIR or received by IrRecvCallback)
+	//! data: Signal data, each byte is bit 7 - mark, bits 0..6 - duration in ticks
+	//! size: Size of data
+	//! Return: true - success, false - signal is empty
+	//! Note: Adjacent blocks of the same level are merged
+	bool DecodeBlocks(const uint8_t * data, int size);
+
+	//! Encode to Tiqiaa signal data
+	//! out: Output signal data, suitable for TiqiaaUsbIr::SendIR
+	void EncodeBlocks(std::vector<uint8_t> &out) const;
+
+	//! Normalise signal: drop leading space, clamp long spaces and make it end with space
+	//! MaxGap: Max space duration, usec
+	void Normalise(uint32_t MaxGap = DefaultMaxGap);
+
+	//! Parse library entry
+	//! line: One line of signal library
+	//! name: Output signal name
+	//! Return: true - success, false - line is empty, comment or malformed
+	bool ParseLibraryEntry(const char * line, std::string &name);
+
+	//! Parse Pronto hex code
+	//! text: Code words, once sequence is used, or repeat sequence if there is no once sequence
+	//! Return: true - success, false - malformed or not learned (0000) code
+	bool ParsePronto(const char * text);
+
+	//! Parse Broadlink IR packet
+	//! text: Packet in base64, repeat count is ignored, carrier is DefaultFreq
+	//! Return: true - success, false - malformed or not IR packet
+	bool ParseBroadlink(const char * text);
+
+	//! Append library entry (one line)
+	//! out: Output string
+	//! name: Signal name
+	void WriteLibraryEntry(std::string &out, const char * name) const;
+
+	//! Append code of lircd.conf raw_codes section
+	//! out: Output string
+	//! name: Code name
+	void WriteLircRaw(std::string &out, const char * name) const;
+
+	//! Append Pronto hex code (one line)
+	//! out: Output string
+	void WritePronto(std::string &out) const;
+
+	//! Append Broadlink IR packet in base64 (one line)
+	//! out: Output string
+	void WriteBroadlink(std::string &out) const;
+
+	//! Append code in given format, Pronto and Broadlink codes are preceded by "# name" line
+	//! format: One of Format* constant
+	//! out: Output string
+	//! name: Code name
+	void Write(int format, std::string &out, const char * name) const;
+
+	//! Append lircd.conf lines preceding raw codes
+	//! out: Output string
+	//! name: Remote name
+	//! freq: Carrier freq, Hz
+	//! gap: Gap between signals, usec
+	static void WriteLircHeader(std::string &out, const char * name, int freq, uint32_t gap);
+
+	//! Append lircd.conf lines following raw codes
+	//! out: Output string
+	static void WriteLircFooter(std::string &out);
+};
+
+#endif
@@ -0,0 +1,121 @@
+/*
+ * Low-overhead event tracing of Tiqiaa Tview USB IR driver internals
+ */
+
+#include "TiqiaaEventTrace.h"
+#include "TiqiaaUsb.h"
+#include <stdio.h>
+#include <vector>
+
+volatile LONG TiqiaaEventTrace::Enabled = 0;
+
+//ring buffers of all threads that have written events, kept after thread exit until process end
+struct TiqiaaEventTraceRegistry{
+	CRITICAL_SECTION Cs;
+	std::vector<void *> Rings;
+
+	TiqiaaEventTraceRegistry(){ InitializeCriticalSection(&Cs); }
+};
+
+static TiqiaaEventTraceRegistry &GetRegistry(){
+	static TiqiaaEventTraceRegistry Registry;
+	return Registry;
+}
+
+static thread_local void * ThreadRing = NULL;
+static thread_local const char * ThreadName = NULL;
+
+TiqiaaEventTrace::Ring * TiqiaaEventTrace::GetRing(){
+	Ring * r = (Ring *)ThreadRing;
+
+	if (r != NULL) return r;
+	//registry lock is taken once per thread
+	r = new Ring;
+	r->Head = 0;
+	r->ThreadId = GetCurrentThreadId();
+	r->ThreadName = ThreadName;
+	EnterCriticalSection(&GetRegistry().Cs);
+	GetRegistry().Rings.push_back(r);
+	LeaveCriticalSection(&GetRegistry().Cs);
+	ThreadRing = r;
+	return r;
+}
+
+void TiqiaaEventTrace::Enable(bool enable){
+	InterlockedExchange(&Enabled, enable ? 1 : 0);
+}
+
+void TiqiaaEventTrace::Write(char phase, const char * name, int64_t arg){
+	Ring * r = GetRing();
+	TiqiaaEventTraceEvent * Event = &r->Events[(uint32_t)r->Head & (RingSize - 1)];
+
+	Event->Time = TiqiaaUsbIr::GetTimeNs();
+	Event->Name = name;
+	Event->Arg = arg;
+	Event->Phase = phase;
+	//publish event to exporting thread
+	InterlockedIncrement(&r->Head);
+}
+
+void TiqiaaEventTrace::SetThreadName(const char * name){
+	//ring buffer is allocated by first event, so threads that are never traced cost nothing
+	ThreadName = name;
+	if (ThreadRing != NULL) ((Ring *)ThreadRing)->ThreadName = name;
+}
+
+void TiqiaaEventTrace::Clear(){
+	size_t i;
+
+	EnterCriticalSection(&GetRegistry().Cs);
+	for (i = 0; i < GetRegistry().Rings.size(); i++) InterlockedExchange(&((Ring *)GetRegistry().Rings[i])->Head, 0);
+	LeaveCriticalSection(&GetRegistry().Cs);
+}
+
+bool TiqiaaEventTrace::WriteChromeJson(const char * path){
+	FILE * f;
+	Ring * r;
+	TiqiaaEventTraceEvent * Event;
+	uint32_t Head, First, k;
+	int64_t StartTime = INT64_MAX;
+	bool IsFirst = true;
+	size_t i;
+	bool res;
+
+	f = fopen(path, "wb");
+	if (f == NULL) return false;
+	EnterCriticalSection(&GetRegistry().Cs);
+	for (i = 0; i < GetRegistry().Rings.size(); i++){
+		r = (Ring *)GetRegistry().Rings[i];
+		Head = (uint32_t)r->Head;
+		First = (Head > RingSize) ? (Head - RingSize) : 0;
+		if ((Head > First) && (r->Events[First & (RingSize - 1)].Time < StartTime)) StartTime = r->Events[First & (RingSize - 1)].Time;
+	}
+
+	fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	for (i = 0; i < GetRegistry().Rings.size(); i++){
+		r = (Ring *)GetRegistry().Rings[i];
+		if (r->ThreadName != NULL){
+			fprintf(f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%lu,\"args\":{\"name\":\"%s\"}}", IsFirst ? "" : ",", (unsigned long)r->ThreadId, r->ThreadName);
+			IsFirst = false;
+		}
+		Head = (uint32_t)r->Head;
+		First = (Head > RingSize) ? (Head - RingSize) : 0;
+		for (k = First; k < Head; k++){
+			Event = &r->Events[k & (RingSize - 1)];
+			fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%lu", IsFirst ? "" : ",", Event->Name, Event->Phase, (Event->Time - StartTime) / 1000.0, (unsigned long)r->ThreadId);
+			if (Event->Phase == TiqiaaEventTrace_Counter){
+				fprintf(f, ",\"args\":{\"value\":%lld}}", (long long)Event->Arg);
+			} else if (Event->Phase == TiqiaaEventTrace_Instant){
+				fprintf(f, ",\"s\":\"t\",\"args\":{\"arg\":%lld}}", (long long)Event->Arg);
+			} else {
+				fprintf(f, ",\"args\":{\"arg\":%lld}}", (long long)Event->Arg);
+			}
+			IsFirst = false;
+		}
+	}
+	LeaveCriticalSection(&GetRegistry().Cs);
+	fprintf(f, "\n]}\n");
+	res = (ferror(f) == 0);
+	fclose(f);
+	return res;
+}
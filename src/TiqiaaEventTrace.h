@@ -0,0 +1,98 @@
+/*
+ * Low-overhead event tracing of Tiqiaa Tview USB IR driver internals
+ *
+ * Trace points write fixed-size events to a ring buffer owned by the calling thread, so writing
+ * an event takes no lock and never blocks. When a ring buffer is full, its oldest events are
+ * overwritten. Collected events can be exported to Chrome trace-event JSON (chrome://tracing,
+ * ui.perfetto.dev).
+ *
+ * Trace points are compiled out when TIQIAA_EVENT_TRACE is defined as 0. When compiled in,
+ * a disabled trace point costs one flag check.
+ *
+ * Example:
+ *
+ * TiqiaaEventTrace::Enable(true);
+ * Ir.Open(IrDev[0].c_str());
+ * ...
+ * Ir.Close();
+ * TiqiaaEventTrace::Enable(false);
+ * TiqiaaEventTrace::WriteChromeJson("trace.json");
+ */
+
+#ifndef TIQIAA_EVENT_TRACE_H
+#define TIQIAA_EVENT_TRACE_H
+
+#include <windows.h>
+#include <stdint.h>
+
+#ifndef TIQIAA_EVENT_TRACE
+#define TIQIAA_EVENT_TRACE 1
+#endif
+
+const char TiqiaaEventTrace_Begin = 'B';
+const char TiqiaaEventTrace_End = 'E';
+const char TiqiaaEventTrace_Instant = 'i';
+const char TiqiaaEventTrace_Counter = 'C';
+
+struct TiqiaaEventTraceEvent{
+	int64_t Time; //nsec, TiqiaaUsbIr::GetTimeNs()
+	const char * Name; //string literal
+	int64_t Arg;
+	char Phase; //TiqiaaEventTrace_* constant
+};
+
+class TiqiaaEventTrace {
+	private:
+	static const uint32_t RingSize = 16384; //events per thread, power of 2
+
+	struct Ring{
+		TiqiaaEventTraceEvent Events[RingSize];
+		volatile LONG Head; //number of events written, only owning thread changes it
+		DWORD ThreadId;
+		const char * ThreadName;
+	};
+
+	static volatile LONG Enabled;
+
+	static Ring * GetRing();
+
+	public:
+	//! Start or stop collecting events
+	static void Enable(bool enable);
+
+	//! Return: true - events are collected
+	static bool IsEnabled(){ return Enabled != 0; }
+
+	//! Write event to ring buffer of calling thread
+	//! phase: TiqiaaEventTrace_* constant
+	//! name: Event name, should be string literal
+	//! arg: Event argument, counter value for TiqiaaEventTrace_Counter
+	static void Write(char phase, const char * name, int64_t arg);
+
+	//! Set name of calling thread shown in trace
+	//! name: Thread name, should be string literal
+	static void SetThreadName(const char * name);
+
+	//! Drop collected events, should be called when traced threads are idle
+	static void Clear();
+
+	//! Export collected events, should be called when traced threads are idle
+	//! path: Path to JSON file
+	//! Return: true - success, false - fail
+	static bool WriteChromeJson(const char * path);
+};
+
+#if TIQIAA_EVENT_TRACE
+#define TIQIAA_TRACE(phase, name, arg) do { if (TiqiaaEventTrace::IsEnabled()) TiqiaaEventTrace::Write(phase, name, (int64_t)(arg)); } while (0)
+#define TIQIAA_TRACE_THREAD_NAME(name) TiqiaaEventTrace::SetThreadName(name)
+#else
+#define TIQIAA_TRACE(phase, name, arg) do {} while (0)
+#define TIQIAA_TRACE_THREAD_NAME(name) do {} while (0)
+#endif
+
+#define TIQIAA_TRACE_BEGIN(name, arg) TIQIAA_TRACE(TiqiaaEventTrace_Begin, name, arg)
+#define TIQIAA_TRACE_END(name, arg) TIQIAA_TRACE(TiqiaaEventTrace_End, name, arg)
+#define TIQIAA_TRACE_INSTANT(name, arg) TIQIAA_TRACE(TiqiaaEventTrace_Instant, name, arg)
+#define TIQIAA_TRACE_COUNTER(name, value) TIQIAA_TRACE(TiqiaaEventTrace_Counter, name, value)
+
+#endif
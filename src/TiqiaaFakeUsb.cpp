@@ -0,0 +1,327 @@
+/*
+ * Simulated Tiqiaa Tview USB IR Transeiver
+ */
+
+#include "TiqiaaFakeUsb.h"
+#include "IrSignal.h"
+
+TiqiaaFakeUsbIr::TiqiaaFakeUsbIr(){
+	InitializeCriticalSection(&FakeCs);
+	ReadQueueEvent = CreateEvent(NULL, false, false, NULL);
+	ReadAborted = false;
+	ReadQueueHead = 0;
+	ReadQueueCount = 0;
+	FakeState = StateIdle;
+	RecvArmed = false;
+	RecvCmdId = 0;
+	OutPacketIndex = 0;
+	InPackSize = 0;
+	DropReplyRate = 0;
+	ReplyDelay = 0;
+	ReplyDelayJitter = 0;
+	DropNextReplies = 0;
+	DroppedReplyCount = 0;
+	HostCmdCount = 0;
+	LinkPeer = NULL;
+	LinkTxTime = 0;
+	LinkMarkStretch = 0;
+	LinkEdgeJitter = 0;
+	LinkDelay = 0;
+	SetSeed(1);
+}
+
+TiqiaaFakeUsbIr::~TiqiaaFakeUsbIr(){
+	//base destructor can't reach overridden transport
+	Close();
+	CloseHandle(ReadQueueEvent);
+	DeleteCriticalSection(&FakeCs);
+}
+
+void TiqiaaFakeUsbIr::SetSeed(uint32_t seed){
+	RandState = (seed != 0) ? seed : 1;
+}
+
+uint32_t TiqiaaFakeUsbIr::Rand(){
+	//xorshift32
+	RandState ^= RandState << 13;
+	RandState ^= RandState >> 17;
+	RandState ^= RandState << 5;
+	return RandState;
+}
+
+bool TiqiaaFakeUsbIr::OpenTransport(const char * device_path){
+	EnterCriticalSection(&FakeCs);
+	ReadQueueCount = 0;
+	ReadAborted = false;
+	FakeState = StateIdle;
+	RecvArmed = false;
+	InPackSize = 0;
+	HostCmdCount = 0;
+	LeaveCriticalSection(&FakeCs);
+	return true;
+}
+
+void TiqiaaFakeUsbIr::CloseTransport(){
+	EnterCriticalSection(&FakeCs);
+	ReadQueueCount = 0;
+	LeaveCriticalSection(&FakeCs);
+}
+
+void TiqiaaFakeUsbIr::AbortRead(){
+	EnterCriticalSection(&FakeCs);
+	ReadAborted = true;
+	SetEvent(ReadQueueEvent);
+	LeaveCriticalSection(&FakeCs);
+}
+
+bool TiqiaaFakeUsbIr::ReadReport(uint8_t * data, int size, ULONG * rx_size){
+	int64_t Now;
+	DWORD WaitTime;
+
+	for (;;){
+		WaitTime = INFINITE;
+		EnterCriticalSection(&FakeCs);
+		if (ReadAborted){
+			LeaveCriticalSection(&FakeCs);
+			return false;
+		}
+		if (ReadQueueCount > 0){
+			FakeReport &Report = QueueAt(0);
+			Now = GetTimeNs();
+			if (Report.DueTime <= Now){
+				if (size > Report.Size) size = Report.Size;
+				memcpy(data, Report.Data, size);
+				*rx_size = size;
+				ReadQueueHead = (ReadQueueHead + 1) % ReadQueueSize;
+				ReadQueueCount --;
+				LeaveCriticalSection(&FakeCs);
+				return true;
+			}
+			WaitTime = (DWORD)((Report.DueTime - Now) / 1000000 + 1);
+		}
+		LeaveCriticalSection(&FakeCs);
+		WaitForSingleObject(ReadQueueEvent, WaitTime);
+	}
+}
+
+TiqiaaFakeUsbIr::FakeReport &TiqiaaFakeUsbIr::QueueAt(int pos){
+	return ReadQueue[(ReadQueueHead + pos) % ReadQueueSize];
+}
+
+int TiqiaaFakeUsbIr::GetHostCmdCount(){
+	int res;
+
+	EnterCriticalSection(&FakeCs);
+	res = HostCmdCount;
+	LeaveCriticalSection(&FakeCs);
+	return res;
+}
+
+bool TiqiaaFakeUsbIr::GetHostCmd(int index, uint8_t * cmdId, uint8_t * cmdType){
+	bool res = false;
+
+	EnterCriticalSection(&FakeCs);
+	if ((index >= 0) && (index < HostCmdCount) && (index >= HostCmdCount - HostCmdLogSize)){
+		*cmdId = HostCmdIds[index % HostCmdLogSize];
+		*cmdType = HostCmdTypes[index % HostCmdLogSize];
+		res = true;
+	}
+	LeaveCriticalSection(&FakeCs);
+	return res;
+}
+
+void TiqiaaFakeUsbIr::LinkTo(TiqiaaFakeUsbIr * peer){
+	EnterCriticalSection(&FakeCs);
+	LinkPeer = peer;
+	LeaveCriticalSection(&FakeCs);
+}
+
+bool TiqiaaFakeUsbIr::WriteReport(uint8_t * data, int size){
+	TiqiaaUsbIr_Report2Header * ReportHdr = (TiqiaaUsbIr_Report2Header *)data;
+	int FragmSize;
+	std::vector<uint8_t> Tx;
+	TiqiaaFakeUsbIr * Peer;
+
+	if ((size <= (int)sizeof(TiqiaaUsbIr_Report2Header)) || (ReportHdr->ReportId != WriteReportId)) return false;
+	FragmSize = ReportHdr->FragmSize + 2 - sizeof(TiqiaaUsbIr_Report2Header);
+	if (FragmSize > (size - (int)sizeof(TiqiaaUsbIr_Report2Header))) return false;
+	EnterCriticalSection(&FakeCs);
+	if (ReportHdr->FragmIdx == 1) InPackSize = 0;
+	if ((InPackSize + FragmSize) <= MaxUsbPacketSize){
+		memcpy(InPack + InPackSize, data + sizeof(TiqiaaUsbIr_Report2Header), FragmSize);
+		InPackSize += FragmSize;
+		if (ReportHdr->FragmIdx == ReportHdr->FragmCount){
+			if ((InPackSize >= 6) && (*((uint16_t *)InPack) == PackStartSign) && (*((uint16_t *)(InPack + InPackSize - 2)) == PackEndSign)){
+				ProcessHostPacket(InPack + 2, InPackSize - 4);
+			}
+			InPackSize = 0;
+		}
+	} else {
+		InPackSize = 0;
+	}
+	Tx.swap(LinkTx);
+	Peer = LinkPeer;
+	LeaveCriticalSection(&FakeCs);
+	//peer lock is taken without holding own one, so devices linked to each other can't deadlock
+	if (!Tx.empty() && (Peer != NULL)) Peer->QueueIrSignal(&Tx[0], (int)Tx.size(), LinkTxTime);
+	return true;
+}
+
+void TiqiaaFakeUsbIr::ProcessHostPacket(uint8_t * pack, int size){
+	uint8_t cmdId = pack[0];
+	TiqiaaUsbIr_VersionPacket Version;
+
+	HostCmdIds[HostCmdCount % HostCmdLogSize] = cmdId;
+	HostCmdTypes[HostCmdCount % HostCmdLogSize] = pack[1];
+	HostCmdCount ++;
+	switch (pack[1]){
+		case CmdVersion:
+			memset(&Version, 0, sizeof(Version));
+			Version.VersionChar = 'F';
+			Version.VersionInt = 1;
+			Version.State = FakeState;
+			QueueReply(cmdId, CmdVersion, &Version, sizeof(Version), 0);
+			break;
+		case CmdIdleMode:
+			FakeState = StateIdle;
+			RecvArmed = false;
+			QueueReply(cmdId, CmdIdleMode, &FakeState, 1, 0);
+			break;
+		case CmdSendMode:
+			FakeState = StateSend;
+			RecvArmed = false;
+			QueueReply(cmdId, CmdSendMode, &FakeState, 1, 0);
+			break;
+		case CmdRecvMode:
+			FakeState = StateRecv;
+			QueueReply(cmdId, CmdRecvMode, &FakeState, 1, 0);
+			break;
+		case CmdCancel:
+			RecvArmed = false;
+			QueueReply(cmdId, CmdCancel, &FakeState, 1, 0);
+			break;
+		case CmdOutput:
+			if (FakeState == StateRecv){
+				//reply comes with received signal
+				RecvArmed = true;
+				RecvCmdId = cmdId;
+			} else {
+				QueueReply(cmdId, CmdOutput, &FakeState, 1, 0);
+			}
+			break;
+		case CmdData:
+			if ((FakeState == StateSend) && (size >= 3) && (pack[2] < TiqiaaUsbIr_IrFreqTableSize)){
+				//output is reported when signal is transmitted
+				QueueReply(cmdId, CmdOutput, &FakeState, 1, GetIrSignalDuration(pack + 3, size - 3));
+				if (LinkPeer != NULL) TransmitToLink(pack + 3, size - 3, GetTimeNs() + GetIrSignalDuration(pack + 3, size - 3));
+			} else {
+				QueueReply(cmdId, CmdUnknown, &FakeState, 1, 0);
+			}
+			break;
+		default:
+			QueueReply(cmdId, CmdUnknown, &FakeState, 1, 0);
+			break;
+	}
+}
+
+void TiqiaaFakeUsbIr::TransmitToLink(const uint8_t * data, int size, int64_t endTime){
+	IrSignal Signal;
+	int64_t EdgeTime = 0;
+	int64_t LastEdgeTime = 0;
+	int64_t Edge;
+	size_t i;
+
+	if (!Signal.DecodeBlocks(data, size)) return;
+	//edges are moved at their absolute positions, so errors don't accumulate over the signal
+	for (i = 0; i < Signal.Durations.size(); i++){
+		EdgeTime += Signal.Durations[i];
+		Edge = EdgeTime;
+		if ((i % 2) == 0) Edge += LinkMarkStretch;
+		if ((LinkEdgeJitter > 0) && ((i + 1) < Signal.Durations.size())) Edge += (int64_t)(Rand() % (2 * LinkEdgeJitter + 1)) - LinkEdgeJitter;
+		if (Edge < LastEdgeTime + IrSignal::TickSize) Edge = LastEdgeTime + IrSignal::TickSize;
+		Signal.Durations[i] = (uint32_t)(Edge - LastEdgeTime);
+		LastEdgeTime = Edge;
+	}
+	Signal.EncodeBlocks(LinkTx);
+	LinkTxTime = endTime + (int64_t)LinkDelay * 1000;
+}
+
+bool TiqiaaFakeUsbIr::InjectIrSignal(const uint8_t * data, int size){
+	return QueueIrSignal(data, size, GetTimeNs());
+}
+
+bool TiqiaaFakeUsbIr::QueueIrSignal(const uint8_t * data, int size, int64_t dueTime){
+	bool res = false;
+
+	EnterCriticalSection(&FakeCs);
+	if ((FakeState == StateRecv) && RecvArmed && IsOpen()){
+		RecvArmed = false;
+		QueuePacket(RecvCmdId, CmdData, data, size, dueTime);
+		res = true;
+	}
+	LeaveCriticalSection(&FakeCs);
+	return res;
+}
+
+void TiqiaaFakeUsbIr::QueueReply(uint8_t cmdId, uint8_t cmdType, const void * data, int size, int64_t delay){
+	if (DropNextReplies > 0){
+		InterlockedDecrement(&DropNextReplies);
+		InterlockedIncrement(&DroppedReplyCount);
+		return;
+	}
+	if ((DropReplyRate > 0) && ((Rand() % 1000000) < (uint32_t)(DropReplyRate * 1000000))){
+		InterlockedIncrement(&DroppedReplyCount);
+		return;
+	}
+	delay += (int64_t)ReplyDelay * 1000000;
+	if (ReplyDelayJitter > 0) delay += (int64_t)(Rand() % (ReplyDelayJitter * 1000)) * 1000;
+	QueuePacket(cmdId, cmdType, data, size, GetTimeNs() + delay);
+}
+
+void TiqiaaFakeUsbIr::QueuePacket(uint8_t cmdId, uint8_t cmdType, const void * data, int size, int64_t dueTime){
+	uint8_t Pack[MaxUsbPacketSize];
+	TiqiaaUsbIr_Report2Header * ReportHdr;
+	FakeReport Report;
+	int Pos;
+	int i;
+	int PackSize;
+	int RdPtr;
+	int FragmSize;
+	int FragmCount;
+
+	if ((size + 6) > MaxUsbPacketSize) return;
+	*(uint16_t *)Pack = PackStartSign;
+	Pack[2] = cmdId;
+	Pack[3] = cmdType;
+	memcpy(Pack + 4, data, size);
+	PackSize = size + 4;
+	*(uint16_t *)(Pack + PackSize) = PackEndSign;
+	PackSize += sizeof(uint16_t);
+
+	FragmCount = (PackSize + MaxUsbFragmSize - 1) / MaxUsbFragmSize;
+	OutPacketIndex ++;
+	if (OutPacketIndex > MaxUsbPacketIndex) OutPacketIndex = 1;
+
+	//replies with different delays can overtake each other, keep queue sorted by due time
+	Pos = ReadQueueCount;
+	while ((Pos > 0) && (QueueAt(Pos - 1).DueTime > dueTime)) Pos--;
+	ReportHdr = (TiqiaaUsbIr_Report2Header *)Report.Data;
+	Report.DueTime = dueTime;
+	for (RdPtr = 0; RdPtr < PackSize; RdPtr += FragmSize){
+		FragmSize = PackSize - RdPtr;
+		if (FragmSize > MaxUsbFragmSize) FragmSize = MaxUsbFragmSize;
+		ReportHdr->ReportId = ReadReportId;
+		ReportHdr->FragmSize = FragmSize + 3;
+		ReportHdr->PacketIdx = OutPacketIndex;
+		ReportHdr->FragmCount = FragmCount;
+		ReportHdr->FragmIdx = RdPtr / MaxUsbFragmSize + 1;
+		memcpy(Report.Data + sizeof(TiqiaaUsbIr_Report2Header), Pack + RdPtr, FragmSize);
+		Report.Size = FragmSize + sizeof(TiqiaaUsbIr_Report2Header);
+		if (ReadQueueCount == ReadQueueSize) break; //USB buffer overflow, rest of packet is lost
+		for (i = ReadQueueCount; i > Pos; i--) QueueAt(i) = QueueAt(i - 1);
+		QueueAt(Pos) = Report;
+		ReadQueueCount ++;
+		Pos ++;
+	}
+	SetEvent(ReadQueueEvent);
+}
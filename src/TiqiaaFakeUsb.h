@@ -0,0 +1,131 @@
+/*
+ * Simulated Tiqiaa Tview USB IR Transeiver
+ *
+ * Emulates device side of the USB protocol without hardware, replies can be dropped or delayed
+ * to exercise timeouts and retries of TiqiaaUsbIr. Two simulated devices can be linked, so signals
+ * sent by one are received by the other through a simulated optical channel.
+ *
+ * Example:
+ *
+ * TiqiaaFakeUsbIr Ir;
+ * Ir.DropReplyRate = 0.1;
+ * Ir.Open("fake");
+ * Ir.SendNecSignal(0x1234);
+ * Ir.Close();
+ *
+ * TiqiaaFakeUsbIr Tx, Rx;
+ * Tx.LinkTo(&Rx);
+ * Tx.Open("fake0");
+ * Rx.Open("fake1");
+ * Rx.StartRecvIR();
+ * Tx.SendNecSignal(0x1234);
+ */
+
+#ifndef TIQIAA_FAKE_USB_H
+#define TIQIAA_FAKE_USB_H
+
+#include "TiqiaaUsb.h"
+
+class TiqiaaFakeUsbIr : public TiqiaaUsbIr {
+	private:
+	static const int ReadQueueSize = 256; //reports, fixed so the simulated device doesn't allocate after Open
+	static const int HostCmdLogSize = 64;
+
+	struct FakeReport{
+		int64_t DueTime;
+		int Size;
+		uint8_t Data[ReportSize];
+	};
+
+	CRITICAL_SECTION FakeCs;
+	HANDLE ReadQueueEvent;
+	FakeReport ReadQueue[ReadQueueSize]; //ring sorted by due time
+	int ReadQueueHead;
+	int ReadQueueCount;
+	bool ReadAborted;
+
+	uint8_t FakeState;
+	bool RecvArmed;
+	uint8_t RecvCmdId;
+	uint8_t OutPacketIndex;
+	uint8_t InPack[MaxUsbPacketSize];
+	int InPackSize;
+	uint32_t RandState;
+	uint8_t HostCmdIds[HostCmdLogSize]; //ring of most recent host commands
+	uint8_t HostCmdTypes[HostCmdLogSize];
+	int HostCmdCount;
+
+	TiqiaaFakeUsbIr * LinkPeer;
+	std::vector<uint8_t> LinkTx; //signal to deliver to peer after FakeCs is released
+	int64_t LinkTxTime;
+
+	public:
+	//! Probability of dropping command reply, 0..1
+	double DropReplyRate;
+
+	//! Extra delay of command replies, msec
+	DWORD ReplyDelay;
+
+	//! Random extra delay of command replies, 0..ReplyDelayJitter msec
+	DWORD ReplyDelayJitter;
+
+	//! Number of next replies to drop regardless of DropReplyRate, for deterministic tests
+	volatile LONG DropNextReplies;
+
+	//! Number of replies dropped so far
+	volatile LONG DroppedReplyCount;
+
+	//! Extra mark duration seen by linked receiver, usec (IR receivers typically stretch marks)
+	int LinkMarkStretch;
+
+	//! Random error of each edge seen by linked receiver, -LinkEdgeJitter..LinkEdgeJitter usec
+	int LinkEdgeJitter;
+
+	//! Delay from end of transmission to signal report of linked receiver, usec
+	int LinkDelay;
+
+	TiqiaaFakeUsbIr();
+	virtual ~TiqiaaFakeUsbIr();
+
+	//! Seed fault injection random generator, for reproducible runs
+	void SetSeed(uint32_t seed);
+
+	//! Feed IR signal to simulated receiver
+	//! data: IR signal data
+	//! size: size of data
+	//! Return: true - signal is delivered, false - receive is not started
+	bool InjectIrSignal(const uint8_t * data, int size);
+
+	//! Deliver signals sent by this device to receiver of another simulated device
+	//! peer: Receiving device, NULL - unlink
+	//! Note: Signal is delivered when its transmission ends, only if peer receive is started
+	void LinkTo(TiqiaaFakeUsbIr * peer);
+
+	//! Return: number of commands received from host since Open
+	int GetHostCmdCount();
+
+	//! Get command received from host
+	//! index: 0 - first command since Open, only HostCmdLogSize most recent commands are kept
+	//! cmdId: Output command ID
+	//! cmdType: Output command type
+	//! Return: true - success, false - no such command
+	bool GetHostCmd(int index, uint8_t * cmdId, uint8_t * cmdType);
+
+	protected:
+	virtual bool OpenTransport(const char * device_path);
+	virtual void CloseTransport();
+	virtual bool WriteReport(uint8_t * data, int size);
+	virtual bool ReadReport(uint8_t * data, int size, ULONG * rx_size);
+	virtual void AbortRead();
+
+	private:
+	uint32_t Rand();
+	FakeReport &QueueAt(int pos);
+	void ProcessHostPacket(uint8_t * pack, int size);
+	void TransmitToLink(const uint8_t * data, int size, int64_t endTime);
+	bool QueueIrSignal(const uint8_t * data, int size, int64_t dueTime);
+	void QueueReply(uint8_t cmdId, uint8_t cmdType, const void * data, int size, int64_t delay);
+	void QueuePacket(uint8_t cmdId, uint8_t cmdType, const void * data, int size, int64_t dueTime);
+};
+
+#endif
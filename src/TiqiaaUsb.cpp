@@ -5,221 +5,540 @@
  */
 
 #include "TiqiaaUsb.h"
+#include "TiqiaaUsbTrace.h"
+#include "TiqiaaEventTrace.h"
 #include <setupapi.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <thread>
+
+//nearest freq ID for every Hz, built once from TiqiaaUsbIr_IrFreqTable
+//1 Hz resolution: table values can be as close as 17 Hz (37900, 37917), a coarser grid would round some freqs to the wrong side of the midpoint
+static const int FreqLookupSize = 65536;
+
+static struct TiqiaaUsbIr_FreqLookup{
+	uint8_t Id[FreqLookupSize];
+
+	TiqiaaUsbIr_FreqLookup(){
+		int i, k, Best;
+
+		for (i = 0; i < FreqLookupSize; i++){
+			Best = 0;
+			for (k = 1; k < TiqiaaUsbIr_IrFreqTableSize; k++){
+				if (abs(TiqiaaUsbIr_IrFreqTable[k] - i) < abs(TiqiaaUsbIr_IrFreqTable[Best] - i)) Best = k;
+			}
+			Id[i] = (uint8_t)Best;
+		}
+	}
+} FreqLookup;
 
 #ifndef GUID_DEVINTERFACE_USB_DEVICE
 DEFINE_GUID( GUID_DEVINTERFACE_USB_DEVICE, 0xA5DCBF10L, 0x6530, 0x11D2, 0x90, 0x1F, 0x00, 0xC0, 0x4F, 0xB9, 0x51, 0xED );
 #endif
 
-TiqiaaUsbIr::TiqiaaUsbIr(){
+TiqiaaUsbIr_PacketPool::TiqiaaUsbIr_PacketPool(int count){
+	int i;
+
+	InitializeCriticalSection(&PoolCs);
+	Bufs = new TiqiaaUsbIr_PacketBuf[count];
+	FreeList = NULL;
+	MissCount = 0;
+	for (i = count - 1; i >= 0; i--){
+		Bufs[i].Pool = this;
+		Bufs[i].RefCount = 0;
+		Bufs[i].NextFree = FreeList;
+		FreeList = &Bufs[i];
+	}
+}
+
+TiqiaaUsbIr_PacketPool::~TiqiaaUsbIr_PacketPool(){
+	delete[] Bufs;
+	DeleteCriticalSection(&PoolCs);
+}
+
+TiqiaaUsbIr_PacketBuf * TiqiaaUsbIr_PacketPool::Alloc(){
+	TiqiaaUsbIr_PacketBuf * buf;
+
+	EnterCriticalSection(&PoolCs);
+	buf = FreeList;
+	if (buf != NULL) FreeList = buf->NextFree;
+	LeaveCriticalSection(&PoolCs);
+	if (buf == NULL){
+		InterlockedIncrement(&MissCount);
+		return NULL;
+	}
+	buf->RefCount = 1;
+	buf->NextFree = NULL;
+	buf->Data = buf->Buf + TiqiaaUsbIr_PacketHeadroom;
+	buf->Size = 0;
+	return buf;
+}
+
+void TiqiaaUsbIr_PacketPool::Free(TiqiaaUsbIr_PacketBuf * buf){
+	EnterCriticalSection(&PoolCs);
+	buf->NextFree = FreeList;
+	FreeList = buf;
+	LeaveCriticalSection(&PoolCs);
+}
+
+LONG TiqiaaUsbIr_PacketPool::GetMissCount(){
+	return MissCount;
+}
+
+TiqiaaUsbIr_Completion::TiqiaaUsbIr_Completion() : State(0), Sleepers(0){
+	//on single CPU spinning only delays the completing thread
+	SpinTime = (std::thread::hardware_concurrency() > 1) ? 20000 : 0;
+}
+
+bool TiqiaaUsbIr_Completion::Arm(uint32_t key){
+	uint32_t Expected = 0;
+
+	//fails while previous request is pending, including completed but not yet collected one
+	return State.compare_exchange_strong(Expected, (key & 0xFFFF) | StateArmed);
+}
+
+bool TiqiaaUsbIr_Completion::Complete(uint32_t key){
+	uint32_t Expected = (key & 0xFFFF) | StateArmed;
+
+	if (!State.compare_exchange_strong(Expected, Expected | StateDone)) return false;
+	Wake();
+	return true;
+}
+
+void TiqiaaUsbIr_Completion::Wake(){
+	//waiter registers in Sleepers before checking State under Mutex, so it either sees new State or is counted here
+	if (Sleepers.load() == 0) return;
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+	}
+	Cond.notify_all();
+}
+
+bool TiqiaaUsbIr_Completion::Wait(DWORD timeout){
+	uint32_t s;
+	int64_t SpinEnd;
+
+	s = State.load();
+	if ((s & StateArmed) == 0) return false;
+	if ((s & StateDone) == 0){
+		//reply often lands within microseconds of a short command, wake without scheduler round trip
+		SpinEnd = TiqiaaUsbIr::GetTimeNs() + SpinTime;
+		do {
+			YieldProcessor();
+			s = State.load();
+		} while (((s & (StateArmed | StateDone)) == StateArmed) && (TiqiaaUsbIr::GetTimeNs() < SpinEnd));
+	}
+	if ((s & (StateArmed | StateDone)) == StateArmed){
+		std::unique_lock<std::mutex> Lock(Mutex);
+		Sleepers.fetch_add(1);
+		Cond.wait_for(Lock, std::chrono::milliseconds(timeout), [this, &s]{
+			s = State.load();
+			return (s & (StateArmed | StateDone)) != StateArmed;
+		});
+		Sleepers.fetch_sub(1);
+	}
+	if ((s & StateDone) == 0) return false;
+	//collect completion, fails only if request was cancelled meanwhile
+	return State.compare_exchange_strong(s, 0);
+}
+
+bool TiqiaaUsbIr_Completion::Cancel(){
+	if ((State.exchange(0) & StateArmed) == 0) return false;
+	Wake();
+	return true;
+}
+
+bool TiqiaaUsbIr_Completion::IsArmed(){
+	return (State.load() & StateArmed) != 0;
+}
+
+void TiqiaaUsbIr_PacketBuf::AddRef(){
+	InterlockedIncrement(&RefCount);
+}
+
+void TiqiaaUsbIr_PacketBuf::Release(){
+	if (InterlockedDecrement(&RefCount) == 0) Pool->Free(this);
+}
+
+TiqiaaUsbIr::TiqiaaUsbIr() : TxPool(TxPoolSize), RxPool(RxPoolSize), ReplyPool(ReplyPoolSize){
 	DevHandle = INVALID_HANDLE_VALUE;
 	DevWinUsbHandle = NULL;
+	DevOpen = false;
 	IrRecvCallback = NULL;
+	IrRecvFrameCallback = NULL;
+	TrafficRecorder = NULL;
 	IrRecvCbContext = NULL;
 	PacketIndex = 0;
 	CmdId = 0;
 	DeviceState = 0;
-	InitializeCriticalSection(&WaitCmdCs);
-	WaitCmdEvent = CreateEvent(NULL, false, false, NULL);
+	InitializeCriticalSection(&WriteCs);
+	InitializeCriticalSection(&RepeatStatsCs);
+	RepeatStopEvent = CreateEvent(NULL, true, false, NULL);
+	RepeatThreadHandle = NULL;
+	RepeatActive = false;
+	memset(&RepeatStats, 0, sizeof(RepeatStats));
+	memset(CmdRtt, 0, sizeof(CmdRtt));
+	RetryPolicy.CmdRetries = 2;
+	RetryPolicy.IrRetries = 0;
+	RetryPolicy.MinTimeout = 20;
+	RetryPolicy.MaxTimeout = 2000;
 }
 
 TiqiaaUsbIr::~TiqiaaUsbIr(){
 	Close();
-	CloseHandle(WaitCmdEvent);
-	DeleteCriticalSection(&WaitCmdCs);
+	CloseHandle(RepeatStopEvent);
+	DeleteCriticalSection(&RepeatStatsCs);
+	DeleteCriticalSection(&WriteCs);
+}
+
+int64_t TiqiaaUsbIr::GetTimeNs(){
+	static LARGE_INTEGER Freq;
+	LARGE_INTEGER Counter;
+
+	if (Freq.QuadPart == 0) QueryPerformanceFrequency(&Freq);
+	QueryPerformanceCounter(&Counter);
+	return (Counter.QuadPart / Freq.QuadPart) * 1000000000 + ((Counter.QuadPart % Freq.QuadPart) * 1000000000) / Freq.QuadPart;
 }
 
 bool TiqiaaUsbIr::Open(const char * device_path){
 	if (IsOpen()) return false;
-	DevHandle = CreateFileA(device_path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
-	if (DevHandle == INVALID_HANDLE_VALUE) return false;
-	if (WinUsb_Initialize(DevHandle, &DevWinUsbHandle)){
-		IsWaitingCmdReply = false;
-		ReadActive = true;
-		ReadThreadHandle = CreateThread(0, 0, (LPTHREAD_START_ROUTINE)RunReadThreadFn, this, 0, &ReadThreadId);
-		if (ReadThreadHandle != NULL){
-			if (SendCmdAndWaitReply(CmdVersion, GetCmdId(), CmdReplyWaitTimeout)){
-				if (SendCmdAndWaitReply(CmdSendMode, GetCmdId(), CmdReplyWaitTimeout)){
-					return true;
-				}
+	if (!OpenTransport(device_path)) return false;
+	DevOpen = true;
+	DeviceState = 0;
+	CmdReply.Cancel();
+	ReadActive = true;
+	ReadThreadHandle = CreateThread(0, 0, (LPTHREAD_START_ROUTINE)RunReadThreadFn, this, 0, &ReadThreadId);
+	if (ReadThreadHandle != NULL){
+		if (SendCmdAndWaitReply(CmdVersion)){
+			if (SendCmdAndWaitReply(CmdSendMode)){
+				return true;
 			}
-			ReadActive = false;
-			WinUsb_AbortPipe(DevWinUsbHandle, ReadPipeId);
-			WaitForSingleObject(ReadThreadHandle, INFINITE);
 		}
-		WinUsb_Free(DevWinUsbHandle);
+		ReadActive = false;
+		AbortRead();
+		WaitForSingleObject(ReadThreadHandle, INFINITE);
+		CloseHandle(ReadThreadHandle);
 	}
-	CloseHandle(DevHandle);
-	DevHandle = INVALID_HANDLE_VALUE;
+	DevOpen = false;
+	CloseTransport();
 	return false;
 }
 
 bool TiqiaaUsbIr::Close(){
 	if (!IsOpen()) return false;
+	StopRepeat();
 	SetIdleMode();
 	ReadActive = false;
-	WinUsb_AbortPipe(DevWinUsbHandle, ReadPipeId);
-	WinUsb_Free(DevWinUsbHandle);
+	AbortRead();
 	WaitForSingleObject(ReadThreadHandle, INFINITE);
-	CloseHandle(DevHandle);
-	DevHandle = INVALID_HANDLE_VALUE;
+	CloseHandle(ReadThreadHandle);
+	DevOpen = false;
+	CloseTransport();
 	return true;
 }
 
 bool TiqiaaUsbIr::IsOpen(){
-	return (DevHandle != INVALID_HANDLE_VALUE);
+	return DevOpen;
 }
 
-bool TiqiaaUsbIr::SendReport2(void * data, int size){
-	uint8_t FragmBuf[61];
-	TiqiaaUsbIr_Report2Header * ReportHdr = (TiqiaaUsbIr_Report2Header *)FragmBuf;
+bool TiqiaaUsbIr::OpenTransport(const char * device_path){
+	DevHandle = CreateFileA(device_path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+	if (DevHandle == INVALID_HANDLE_VALUE) return false;
+	if (!WinUsb_Initialize(DevHandle, &DevWinUsbHandle)){
+		CloseHandle(DevHandle);
+		DevHandle = INVALID_HANDLE_VALUE;
+		return false;
+	}
+	return true;
+}
+
+void TiqiaaUsbIr::CloseTransport(){
+	WinUsb_Free(DevWinUsbHandle);
+	CloseHandle(DevHandle);
+	DevHandle = INVALID_HANDLE_VALUE;
+}
+
+bool TiqiaaUsbIr::WriteReport(uint8_t * data, int size){
+	ULONG UsbTxSize;
+	return (WinUsb_WritePipe(DevWinUsbHandle, WritePipeId, data, size, &UsbTxSize, NULL) != FALSE);
+}
+
+bool TiqiaaUsbIr::ReadReport(uint8_t * data, int size, ULONG * rx_size){
+	return (WinUsb_ReadPipe(DevWinUsbHandle, ReadPipeId, data, size, rx_size, NULL) != FALSE);
+}
+
+void TiqiaaUsbIr::AbortRead(){
+	WinUsb_AbortPipe(DevWinUsbHandle, ReadPipeId);
+}
+
+bool TiqiaaUsbIr::SendReport2(TiqiaaUsbIr_PacketBuf * pack){
+	TiqiaaUsbIr_Report2Header * ReportHdr;
 	int RdPtr;
 	int FragmIndex;
+	int FragmCount;
 	int FragmSize;
-	ULONG UsbTxSize;
 
 	RdPtr = 0;
-	if ((size <= 0) || (size > MaxUsbPacketSize)) return false;
-	memset(FragmBuf, 0 ,sizeof(FragmBuf));
-	ReportHdr->ReportId = WriteReportId;
-	ReportHdr->FragmCount = size / MaxUsbFragmSize;
-	if ((size % MaxUsbFragmSize) != 0) ReportHdr->FragmCount ++;
+	if ((pack->Size <= 0) || (pack->Size > MaxUsbPacketSize)) return false;
+	if (pack->Data != pack->Buf + TiqiaaUsbIr_PacketHeadroom) return false;
+	FragmCount = pack->Size / MaxUsbFragmSize;
+	if ((pack->Size % MaxUsbFragmSize) != 0) FragmCount ++;
+	TIQIAA_TRACE_BEGIN("SendReport2", pack->Size);
+	EnterCriticalSection(&WriteCs);
 	PacketIndex ++;
 	if (PacketIndex > MaxUsbPacketIndex) PacketIndex = 1;
-	ReportHdr->PacketIdx = PacketIndex;
 	FragmIndex = 0;
-	while (RdPtr < size){
+	while (RdPtr < pack->Size){
 		FragmIndex ++;
-		ReportHdr->FragmIdx = FragmIndex;
-		FragmSize = size - RdPtr;
+		FragmSize = pack->Size - RdPtr;
 		if (FragmSize > MaxUsbFragmSize) FragmSize = MaxUsbFragmSize;
+		//report header is built in place over the tail of previous fragment, which is already sent
+		ReportHdr = (TiqiaaUsbIr_Report2Header *)(pack->Data + RdPtr - sizeof(TiqiaaUsbIr_Report2Header));
+		ReportHdr->ReportId = WriteReportId;
 		ReportHdr->FragmSize = FragmSize + 3;
-		memcpy(FragmBuf + sizeof(TiqiaaUsbIr_Report2Header), ((uint8_t *)data) + RdPtr, FragmSize);
-		if (!WinUsb_WritePipe(DevWinUsbHandle, WritePipeId, FragmBuf, FragmSize + sizeof(TiqiaaUsbIr_Report2Header), &UsbTxSize, NULL)) return false;
+		ReportHdr->PacketIdx = PacketIndex;
+		ReportHdr->FragmCount = FragmCount;
+		ReportHdr->FragmIdx = FragmIndex;
+		if (TrafficRecorder != NULL) TrafficRecorder->WriteReport(TiqiaaUsbTrace_DirOut, GetTimeNs(), (uint8_t *)ReportHdr, FragmSize + sizeof(TiqiaaUsbIr_Report2Header));
+		TIQIAA_TRACE_BEGIN("WriteReport", (PacketIndex << 8) | FragmIndex);
+		if (!WriteReport((uint8_t *)ReportHdr, FragmSize + sizeof(TiqiaaUsbIr_Report2Header))){
+			TIQIAA_TRACE_END("WriteReport", 0);
+			break;
+		}
+		TIQIAA_TRACE_END("WriteReport", 1);
 		RdPtr += FragmSize;
 	}
-	return true;
+	LeaveCriticalSection(&WriteCs);
+	TIQIAA_TRACE_END("SendReport2", RdPtr >= pack->Size);
+	return (RdPtr >= pack->Size);
 }
 
 bool TiqiaaUsbIr::SendCmd(uint8_t cmdType, uint8_t cmdId){
-	TiqiaaUsbIr_SendCmdPack Pack;
-
-	Pack.StartSign = PackStartSign;
-	Pack.CmdType = cmdType;
-	Pack.CmdId = cmdId;
-	Pack.EndSign = PackEndSign;
-	return SendReport2(&Pack, sizeof(Pack));
+	TiqiaaUsbIr_PacketBuf * Pack;
+	TiqiaaUsbIr_SendCmdPack * CmdPack;
+	bool res;
+
+	Pack = TxPool.Alloc();
+	if (Pack == NULL) return false;
+	CmdPack = (TiqiaaUsbIr_SendCmdPack *)Pack->Data;
+	CmdPack->StartSign = PackStartSign;
+	CmdPack->CmdType = cmdType;
+	CmdPack->CmdId = cmdId;
+	CmdPack->EndSign = PackEndSign;
+	Pack->Size = sizeof(TiqiaaUsbIr_SendCmdPack);
+	res = SendReport2(Pack);
+	Pack->Release();
+	return res;
 }
 
 bool TiqiaaUsbIr::SendIRCmd(int freq, void * buffer, int buf_size, uint8_t cmdId){
-	uint8_t PackBuf[MaxUsbPacketSize];
-	TiqiaaUsbIr_SendIRPackHeader * PackHeader = (TiqiaaUsbIr_SendIRPackHeader *)PackBuf;
-	uint8_t IrFreqId;
+	TiqiaaUsbIr_PacketBuf * Pack;
+	TiqiaaUsbIr_SendIRPackHeader * PackHeader;
+	int IrFreqId = GetIrFreqId(freq);
 	int PackSize = sizeof(TiqiaaUsbIr_SendIRPackHeader);
+	bool res;
 
 	if (buf_size < 0) return false;
 	if ((buf_size + sizeof(TiqiaaUsbIr_SendIRPackHeader) + sizeof(uint16_t)) > MaxUsbPacketSize) return false;
-	if (freq > 255){
-		IrFreqId = 0;
-		while ((IrFreqId < TiqiaaUsbIr_IrFreqTableSize) && (TiqiaaUsbIr_IrFreqTable[IrFreqId] != freq)) IrFreqId++;
-		if (IrFreqId >= TiqiaaUsbIr_IrFreqTableSize) return false;
-	} else {
-		if (freq < TiqiaaUsbIr_IrFreqTableSize) IrFreqId = freq; else return false;
-	}
+	if (IrFreqId < 0) return false;
+	Pack = TxPool.Alloc();
+	if (Pack == NULL) return false;
+	PackHeader = (TiqiaaUsbIr_SendIRPackHeader *)Pack->Data;
 	PackHeader->StartSign = PackStartSign;
 	PackHeader->CmdType = 'D';
 	PackHeader->CmdId = cmdId;
-	PackHeader->IrFreqId = IrFreqId;
-	memcpy(PackBuf + PackSize, buffer, buf_size);
+	PackHeader->IrFreqId = (uint8_t)IrFreqId;
+	memcpy(Pack->Data + PackSize, buffer, buf_size);
 	PackSize += buf_size;
-	*(uint16_t *)(PackBuf + PackSize) = PackEndSign;
+	*(uint16_t *)(Pack->Data + PackSize) = PackEndSign;
 	PackSize += sizeof(uint16_t);
-	return SendReport2(PackBuf, PackSize);
+	Pack->Size = PackSize;
+	res = SendReport2(Pack);
+	Pack->Release();
+	return res;
 }
 
 bool TiqiaaUsbIr::SendCmdAndWaitReply(uint8_t cmdType, uint8_t cmdId, DWORD timeout){
-	if (!StartCmdReplyWaiting(cmdType, cmdId)) return false;
-	if (SendCmd(cmdType, cmdId)){
-		if (WaitCmdReply(timeout)) return true;
+	bool res = false;
+
+	TIQIAA_TRACE_BEGIN("SendCmdAndWaitReply", cmdType);
+	if (StartCmdReplyWaiting(cmdType, cmdId)){
+		if (SendCmd(cmdType, cmdId)) res = WaitCmdReply(timeout);
+		if (!res) CancelCmdReplyWaiting();
+	}
+	TIQIAA_TRACE_END("SendCmdAndWaitReply", res);
+	return res;
+}
+
+bool TiqiaaUsbIr::SendCmdAndWaitReply(uint8_t cmdType){
+	int64_t StartTime;
+	int Attempt;
+
+	for (Attempt = 0; Attempt <= RetryPolicy.CmdRetries; Attempt ++){
+		if (Attempt > 0) TIQIAA_TRACE_INSTANT("CmdRetry", cmdType);
+		StartTime = GetTimeNs();
+		if (SendCmdAndWaitReply(cmdType, GetCmdId(), GetReplyTimeout(cmdType, 0))){
+			//RTT of retried command is ambiguous, don't sample it
+			if (Attempt == 0) UpdateRtt(cmdType, GetTimeNs() - StartTime);
+			return true;
+		}
 	}
-	CancelCmdReplyWaiting();
 	return false;
 }
 
+int TiqiaaUsbIr::GetRttSlot(uint8_t cmdType){
+	switch (cmdType){
+		case CmdVersion: return 1;
+		case CmdIdleMode: return 2;
+		case CmdSendMode: return 3;
+		case CmdRecvMode: return 4;
+		case CmdOutput: return 5;
+		case CmdCancel: return 6;
+		case CmdData: return 7;
+	}
+	return 0;
+}
+
+void TiqiaaUsbIr::UpdateRtt(uint8_t cmdType, int64_t rtt){
+	TiqiaaUsbIr_RttEstimate * Est = &CmdRtt[GetRttSlot(cmdType)];
+	int64_t Delta;
+
+	if (rtt < 0) rtt = 0;
+	if (Est->SampleCount == 0){
+		Est->Srtt = rtt;
+		Est->RttVar = rtt / 2;
+	} else {
+		Delta = (Est->Srtt > rtt) ? (Est->Srtt - rtt) : (rtt - Est->Srtt);
+		Est->RttVar += (Delta - Est->RttVar) / 4;
+		Est->Srtt += (rtt - Est->Srtt) / 8;
+	}
+	Est->SampleCount ++;
+}
+
+DWORD TiqiaaUsbIr::GetReplyTimeout(uint8_t cmdType, int64_t duration){
+	TiqiaaUsbIr_RttEstimate * Est = &CmdRtt[GetRttSlot(cmdType)];
+	int64_t Timeout;
+
+	if (Est->SampleCount == 0){
+		Timeout = (cmdType == CmdOutput) ? IrReplyWaitTimeout : CmdReplyWaitTimeout;
+	} else {
+		Timeout = (Est->Srtt + 4 * Est->RttVar + 999999) / 1000000;
+		if (Timeout < (int64_t)RetryPolicy.MinTimeout) Timeout = RetryPolicy.MinTimeout;
+		if (Timeout > (int64_t)RetryPolicy.MaxTimeout) Timeout = RetryPolicy.MaxTimeout;
+	}
+	return (DWORD)(Timeout + (duration + 999999) / 1000000);
+}
+
+void TiqiaaUsbIr::GetRttEstimate(uint8_t cmdType, TiqiaaUsbIr_RttEstimate * rtt){
+	*rtt = CmdRtt[GetRttSlot(cmdType)];
+}
+
+int TiqiaaUsbIr::GetIrFreqId(int freq){
+	if (freq < 0) return -1;
+	if (freq <= 255) return (freq < TiqiaaUsbIr_IrFreqTableSize) ? freq : -1;
+	if (freq > 65535) freq = 65535;
+	return FreqLookup.Id[freq];
+}
+
+int64_t TiqiaaUsbIr::GetIrSignalDuration(const void * buffer, int buf_size){
+	int64_t Ticks = 0;
+	int i;
+
+	for (i = 0; i < buf_size; i++) Ticks += ((const uint8_t *)buffer)[i] & MaxIrSendBlockSize;
+	return Ticks * IrSendTickSize * 500;
+}
+
+bool TiqiaaUsbIr::ReadIrSignalFile(const char * path, std::vector<uint8_t> &data){
+	uint8_t Buf[TiqiaaUsbIr_MaxPacketSize + 1]; //one extra byte detects longer files
+	size_t Size;
+	FILE * f;
+
+	f = fopen(path, "rb");
+	if (f == NULL) return false;
+	Size = fread(Buf, 1, sizeof(Buf), f);
+	fclose(f);
+	if ((Size == 0) || (Size > TiqiaaUsbIr_MaxPacketSize)) return false;
+	data.assign(Buf, Buf + Size);
+	return true;
+}
+
 uint8_t TiqiaaUsbIr::GetCmdId(){
+	uint8_t res;
+	EnterCriticalSection(&WriteCs);
 	if (CmdId < MaxCmdId) CmdId ++; else CmdId = 1;
-	return CmdId;
+	res = CmdId;
+	LeaveCriticalSection(&WriteCs);
+	return res;
 }
 
 bool TiqiaaUsbIr::StartCmdReplyWaiting(uint8_t cmdType, uint8_t cmdId){
 	if (!IsOpen()) return false;
-	EnterCriticalSection(&WaitCmdCs);
-	if (IsWaitingCmdReply) return false;
-	WaitCmdId = cmdId;
-	WaitCmdType = cmdType;
-	IsWaitingCmdReply = true;
-	IsCmdReplyReceived = false;
-	LeaveCriticalSection(&WaitCmdCs);
-	return true;
+	return CmdReply.Arm(((uint32_t)cmdId << 8) | cmdType);
 }
 
 bool TiqiaaUsbIr::WaitCmdReply(DWORD timeout){
-	bool res = false;
+	bool res;
 	if (!IsOpen()) return false;
-	if (!IsWaitingCmdReply) return false;
-	WaitForSingleObject(WaitCmdEvent, timeout);
-	EnterCriticalSection(&WaitCmdCs);
-	if (IsWaitingCmdReply && IsCmdReplyReceived){
-		res = true;
-		IsWaitingCmdReply = false;
-	}
-	LeaveCriticalSection(&WaitCmdCs);
+	if (!CmdReply.IsArmed()) return false;
+	TIQIAA_TRACE_BEGIN("WaitCmdReply", timeout);
+	res = CmdReply.Wait(timeout);
+	TIQIAA_TRACE_END("WaitCmdReply", res);
 	return res;
 }
 
 bool TiqiaaUsbIr::CancelCmdReplyWaiting(){
-	bool res = false;
 	if (!IsOpen()) return false;
-
-	EnterCriticalSection(&WaitCmdCs);
-	if (IsWaitingCmdReply){
-		IsWaitingCmdReply = false;
-		res = true;
-	}
-	LeaveCriticalSection(&WaitCmdCs);
-	return res;
+	return CmdReply.Cancel();
 }
 
 bool TiqiaaUsbIr::SetIdleMode(){
 	if (!IsOpen()) return false;
 	if (DeviceState == StateIdle) return true;
-	if (SendCmdAndWaitReply(CmdIdleMode, GetCmdId(), CmdReplyWaitTimeout)){
+	if (SendCmdAndWaitReply(CmdIdleMode)){
 		if (DeviceState == StateIdle) return true;
 	}
 	return false;
 }
 
-bool TiqiaaUsbIr::SendIR(int freq, void * buffer, int buf_size){
+bool TiqiaaUsbIr::SetSendMode(){
 	if (!IsOpen()) return false;
-	if (DeviceState != StateSend){
-		if (!SendCmdAndWaitReply(CmdSendMode, GetCmdId(), CmdReplyWaitTimeout)) return false;
+	if (DeviceState == StateSend) return true;
+	if (SendCmdAndWaitReply(CmdSendMode)){
+		if (DeviceState == StateSend) return true;
 	}
-	if (DeviceState != StateSend) return false;
-	uint8_t SendIRCmdId = GetCmdId();
-	if (!StartCmdReplyWaiting(CmdOutput, SendIRCmdId)) return false;
-	if (SendIRCmd(freq, buffer, buf_size, SendIRCmdId)){
-		if (WaitCmdReply(IrReplyWaitTimeout)) return true;
+	return false;
+}
+
+bool TiqiaaUsbIr::SendIR(int freq, void * buffer, int buf_size){
+	int64_t Duration;
+	int64_t StartTime;
+	uint8_t SendIRCmdId;
+	int Attempt;
+
+	if (!SetSendMode()) return false;
+	Duration = GetIrSignalDuration(buffer, buf_size);
+	for (Attempt = 0; Attempt <= RetryPolicy.IrRetries; Attempt ++){
+		SendIRCmdId = GetCmdId();
+		if (!StartCmdReplyWaiting(CmdOutput, SendIRCmdId)) return false;
+		StartTime = GetTimeNs();
+		if (SendIRCmd(freq, buffer, buf_size, SendIRCmdId)){
+			if (WaitCmdReply(GetReplyTimeout(CmdOutput, Duration))){
+				if (Attempt == 0) UpdateRtt(CmdOutput, GetTimeNs() - StartTime - Duration);
+				return true;
+			}
+		}
+		CancelCmdReplyWaiting();
 	}
-	CancelCmdReplyWaiting();
 	return false;
 }
 
 bool TiqiaaUsbIr::StartRecvIR(){
 	if (!IsOpen()) return false;
 	if (DeviceState != StateRecv){
-		if (!SendCmdAndWaitReply(CmdRecvMode, GetCmdId(), CmdReplyWaitTimeout)) return false;
+		if (!SendCmdAndWaitReply(CmdRecvMode)) return false;
 		if (DeviceState != StateRecv) return false;
-		if (!SendCmdAndWaitReply(CmdCancel, GetCmdId(), CmdReplyWaitTimeout)) return false;
+		if (!SendCmdAndWaitReply(CmdCancel)) return false;
 	}
 	if (!SendCmd(CmdOutput, GetCmdId())) return false;
 	return true;
@@ -233,6 +552,129 @@ bool TiqiaaUsbIr::SendNecSignal(uint16_t IrCode){
 	return SendIR(38000, Buf, BufSize);
 }
 
+bool TiqiaaUsbIr::StartRepeat(uint16_t IrCode){
+	DWORD ThreadId;
+
+	if (!IsOpen()) return false;
+	//thread that exited after write or timer failure is reaped, only running one blocks new repeat
+	if ((RepeatThreadHandle != NULL) && (WaitForSingleObject(RepeatThreadHandle, 0) == WAIT_OBJECT_0)) StopRepeat();
+	if (RepeatThreadHandle != NULL) return false;
+	if (!SetSendMode()) return false;
+	EnterCriticalSection(&RepeatStatsCs);
+	memset(&RepeatStats, 0, sizeof(RepeatStats));
+	LeaveCriticalSection(&RepeatStatsCs);
+	RepeatIrCode = IrCode;
+	RepeatActive = true;
+	ResetEvent(RepeatStopEvent);
+	RepeatThreadHandle = CreateThread(0, 0, (LPTHREAD_START_ROUTINE)RunRepeatThreadFn, this, 0, &ThreadId);
+	if (RepeatThreadHandle == NULL){
+		RepeatActive = false;
+		return false;
+	}
+	return true;
+}
+
+bool TiqiaaUsbIr::StopRepeat(){
+	if (RepeatThreadHandle == NULL) return false;
+	RepeatActive = false;
+	SetEvent(RepeatStopEvent);
+	WaitForSingleObject(RepeatThreadHandle, INFINITE);
+	CloseHandle(RepeatThreadHandle);
+	RepeatThreadHandle = NULL;
+	return true;
+}
+
+void TiqiaaUsbIr::GetRepeatStats(TiqiaaUsbIr_RepeatStats * stats){
+	EnterCriticalSection(&RepeatStatsCs);
+	*stats = RepeatStats;
+	LeaveCriticalSection(&RepeatStatsCs);
+}
+
+DWORD WINAPI TiqiaaUsbIr::RunRepeatThreadFn(TiqiaaUsbIr * cls)
+{
+	if (cls != NULL) cls->RepeatThreadFn();
+	return 0;
+}
+
+void TiqiaaUsbIr::RepeatThreadFn(){
+	uint8_t FrameBuf[128];
+	int FrameSize;
+	uint8_t RepeatBuf[32];
+	int RepeatSize;
+	HANDLE RepeatTimer;
+	HANDLE WaitHandles[2];
+	LARGE_INTEGER DueTime;
+	int64_t Deadline;
+	int64_t SendTime;
+	int64_t Now;
+	int64_t WriteStart;
+	int64_t WriteEnd;
+	int64_t LastWriteEnd = 0;
+	int64_t WriteLatency = 0;
+	double Period;
+	double PeriodSum = 0;
+	double PeriodSqSum = 0;
+	int PeriodCount = 0;
+	bool res;
+
+	FrameSize = WriteIrNecFrame(RepeatIrCode, FrameBuf, NecRepeatTailPulses);
+	RepeatSize = WriteIrNecRepeatFrame(RepeatBuf, NecRepeatTailPulses);
+	RepeatTimer = CreateWaitableTimerExA(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+	if (RepeatTimer == NULL) RepeatTimer = CreateWaitableTimerA(NULL, FALSE, NULL); //high resolution timer requires Windows 10 1803
+	if (RepeatTimer == NULL){
+		RepeatActive = false;
+		return;
+	}
+	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+	TIQIAA_TRACE_THREAD_NAME("TiqiaaUsbIr repeat");
+	WaitHandles[0] = RepeatStopEvent;
+	WaitHandles[1] = RepeatTimer;
+	Deadline = GetTimeNs();
+	while (RepeatActive){
+		//frame is written ahead of deadline by measured write latency, so it reaches device in time
+		SendTime = Deadline - WriteLatency;
+		Now = GetTimeNs();
+		if ((SendTime - Now) > RepeatSpinTime){
+			DueTime.QuadPart = -((SendTime - Now - RepeatSpinTime) / 100);
+			SetWaitableTimer(RepeatTimer, &DueTime, 0, NULL, NULL, FALSE);
+			if (WaitForMultipleObjects(2, WaitHandles, FALSE, INFINITE) != (WAIT_OBJECT_0 + 1)) break;
+		}
+		while (GetTimeNs() < SendTime);
+		WriteStart = GetTimeNs();
+		if (LastWriteEnd == 0){
+			res = SendIRCmd(38000, FrameBuf, FrameSize, GetCmdId());
+		} else {
+			res = SendIRCmd(38000, RepeatBuf, RepeatSize, GetCmdId());
+		}
+		WriteEnd = GetTimeNs();
+		if (!res) break;
+		WriteLatency += ((WriteEnd - WriteStart) - WriteLatency) / 8;
+
+		EnterCriticalSection(&RepeatStatsCs);
+		RepeatStats.FrameCount ++;
+		if ((WriteEnd - Deadline) / 1000.0 > RepeatStats.MaxLateUs) RepeatStats.MaxLateUs = (WriteEnd - Deadline) / 1000.0;
+		if (LastWriteEnd != 0){
+			Period = (WriteEnd - LastWriteEnd) / 1000.0;
+			PeriodCount ++;
+			PeriodSum += Period;
+			PeriodSqSum += Period * Period;
+			if ((PeriodCount == 1) || (Period < RepeatStats.MinPeriodUs)) RepeatStats.MinPeriodUs = Period;
+			if ((PeriodCount == 1) || (Period > RepeatStats.MaxPeriodUs)) RepeatStats.MaxPeriodUs = Period;
+			RepeatStats.MeanPeriodUs = PeriodSum / PeriodCount;
+			RepeatStats.JitterUs = PeriodSqSum / PeriodCount - RepeatStats.MeanPeriodUs * RepeatStats.MeanPeriodUs;
+			RepeatStats.JitterUs = (RepeatStats.JitterUs > 0) ? sqrt(RepeatStats.JitterUs) : 0;
+		}
+		LeaveCriticalSection(&RepeatStatsCs);
+
+		LastWriteEnd = WriteEnd;
+		Deadline += NecRepeatPeriod;
+		if (Deadline < WriteEnd) Deadline = WriteEnd + NecRepeatPeriod; //too late, skip missed slots
+	}
+	RepeatActive = false;
+	CancelWaitableTimer(RepeatTimer);
+	CloseHandle(RepeatTimer);
+}
+
 
 void TiqiaaUsbIr::WriteIrNecSignalPulse(TqIrWriteData * IrWrData, int PulseCount, bool isSet){
 	int TickCount;
@@ -253,6 +695,29 @@ void TiqiaaUsbIr::WriteIrNecSignalPulse(TqIrWriteData * IrWrData, int PulseCount
 }
 
 int TiqiaaUsbIr::WriteIrNecSignal(uint16_t IrCode, uint8_t * OutBuf){
+	return WriteIrNecFrame(IrCode, OutBuf, NecFrameTailPulses);
+}
+
+int TiqiaaUsbIr::WriteIrNecRepeatSignal(uint8_t * OutBuf){
+	return WriteIrNecRepeatFrame(OutBuf, NecRepeatFrameTailPulses);
+}
+
+int TiqiaaUsbIr::WriteIrNecRepeatFrame(uint8_t * OutBuf, int TailPulseCount){
+	TqIrWriteData WriteData;
+
+	WriteData.Buf = OutBuf;
+	WriteData.Size = 0;
+	WriteData.PulseTime = 0;
+	WriteData.SenderTime = 0;
+
+	WriteIrNecSignalPulse(&WriteData, 16, true);
+	WriteIrNecSignalPulse(&WriteData, 4, false);
+	WriteIrNecSignalPulse(&WriteData, 1, true);
+	WriteIrNecSignalPulse(&WriteData, TailPulseCount, false);
+	return WriteData.Size;
+}
+
+int TiqiaaUsbIr::WriteIrNecFrame(uint16_t IrCode, uint8_t * OutBuf, int TailPulseCount){
 	TqIrWriteData WriteData;
 	int i;
 	uint32_t tcode;
@@ -276,27 +741,24 @@ int TiqiaaUsbIr::WriteIrNecSignal(uint16_t IrCode, uint8_t * OutBuf){
 		tcode >>= 1;
 	}
 	WriteIrNecSignalPulse(&WriteData, 1, true);
-	WriteIrNecSignalPulse(&WriteData, 72, false);
+	WriteIrNecSignalPulse(&WriteData, TailPulseCount, false);
 	return WriteData.Size;
 }
 
 
-void TiqiaaUsbIr::ProcessRecvPacket(uint8_t * pack, int size){
-	if (IsWaitingCmdReply){
-		EnterCriticalSection(&WaitCmdCs);
-		if (IsWaitingCmdReply && !IsCmdReplyReceived){
-			if ((pack[0] == WaitCmdId) && (pack[1] == WaitCmdType)){
-				IsCmdReplyReceived = true;
-				SetEvent(WaitCmdEvent);
-			}
-		}
-		LeaveCriticalSection(&WaitCmdCs);
-	}
+void TiqiaaUsbIr::ProcessRecvPacket(TiqiaaUsbIr_PacketBuf * frame){
+	uint8_t * pack = frame->Data;
+	int size = frame->Size;
+	uint8_t ReplyCmdId = pack[0];
+	uint8_t ReplyCmdType = pack[1];
+
+	TIQIAA_TRACE_BEGIN("ProcessRecvPacket", ReplyCmdType);
 	switch (pack[1]){
 		case CmdVersion:
 			if (size == (sizeof(TiqiaaUsbIr_VersionPacket) + 2)){
 				TiqiaaUsbIr_VersionPacket * version = (TiqiaaUsbIr_VersionPacket *)(pack + 2);
 				DeviceState = version->State;
+				TIQIAA_TRACE_COUNTER("DeviceState", DeviceState);
 			}
 			break;
 		case CmdIdleMode:
@@ -306,12 +768,25 @@ void TiqiaaUsbIr::ProcessRecvPacket(uint8_t * pack, int size){
 		case CmdCancel:
 		case CmdUnknown:
 			DeviceState = pack[2];
+			TIQIAA_TRACE_COUNTER("DeviceState", DeviceState);
 			break;
 		case CmdData:
 			TiqiaaUsbIr_IrRecvCallback * RecvCallback = IrRecvCallback;
+			TiqiaaUsbIr_IrRecvFrameCallback * RecvFrameCallback = IrRecvFrameCallback;
+			frame->Data = pack + 2;
+			frame->Size = size - 2;
+			TIQIAA_TRACE_BEGIN("IrRecvCallback", size - 2);
+			//frame callback may hold its frame, reserve buffer for replies is never handed to it
+			if (RecvFrameCallback && (frame->Pool == &ReplyPool)) TIQIAA_TRACE_INSTANT("RecvFrameDropped", size - 2);
+			else if (RecvFrameCallback) RecvFrameCallback(frame, this, IrRecvCbContext);
 			if (RecvCallback) RecvCallback(pack + 2, size - 2, this, IrRecvCbContext);
+			TIQIAA_TRACE_END("IrRecvCallback", size - 2);
 			break;
 	}
+	//waiter is woken after DeviceState is updated, it checks the state right away
+	//replies to cancelled or timed out commands don't match pending key and are ignored
+	if (CmdReply.Complete(((uint32_t)ReplyCmdId << 8) | ReplyCmdType)) TIQIAA_TRACE_INSTANT("CmdReply", ReplyCmdId);
+	TIQIAA_TRACE_END("ProcessRecvPacket", ReplyCmdType);
 }
 
 DWORD WINAPI TiqiaaUsbIr::RunReadThreadFn(TiqiaaUsbIr * cls)
@@ -321,8 +796,8 @@ DWORD WINAPI TiqiaaUsbIr::RunReadThreadFn(TiqiaaUsbIr * cls)
 }
 
 void TiqiaaUsbIr::ReadThreadFn(){
-	uint8_t FragmBuf[61];
-	uint8_t PackBuf[MaxUsbPacketSize];
+	uint8_t FragmBuf[ReportSize];
+	TiqiaaUsbIr_PacketBuf * Pack = NULL;
 	int PackSize;
 	int FragmSize;
 	uint8_t PacketIdx;
@@ -332,42 +807,58 @@ void TiqiaaUsbIr::ReadThreadFn(){
 	ULONG UsbRxSize;
 
 	FragmCount = 0; //not receiving packet
+	TIQIAA_TRACE_THREAD_NAME("TiqiaaUsbIr read");
 	while (ReadActive){
-		if (WinUsb_ReadPipe(DevWinUsbHandle, ReadPipeId, FragmBuf, 61, &UsbRxSize, NULL)){
+		if (ReadReport(FragmBuf, sizeof(FragmBuf), &UsbRxSize)){
+			if (TrafficRecorder != NULL) TrafficRecorder->WriteReport(TiqiaaUsbTrace_DirIn, GetTimeNs(), FragmBuf, UsbRxSize);
 			if ((UsbRxSize > sizeof(TiqiaaUsbIr_Report2Header)) && (ReportHdr->ReportId == ReadReportId) && ((ULONG)(ReportHdr->FragmSize + 2) <= UsbRxSize)){
+				TIQIAA_TRACE_INSTANT("ReadReport", (ReportHdr->PacketIdx << 8) | ReportHdr->FragmIdx);
 				if (FragmCount){//adding data to existing packet
 					if ((ReportHdr->PacketIdx == PacketIdx) && (ReportHdr->FragmCount == FragmCount) && (ReportHdr->FragmIdx == (LastFragmIdx + 1))){
 						LastFragmIdx ++;
 					} else {//wrong fragment - drop packet
+						TIQIAA_TRACE_INSTANT("PacketDropped", PacketIdx);
 						FragmCount = 0;
 					}
 				}
 				if (FragmCount == 0){//new packet
 					if ((ReportHdr->FragmCount > 0) && (ReportHdr->FragmIdx == 1)){
-						PacketIdx = ReportHdr->PacketIdx;
-						FragmCount = ReportHdr->FragmCount;
-						LastFragmIdx = LastFragmIdx;
-						PackSize = 0;
-						LastFragmIdx = 1;
+						//reassembly buffer is kept for reuse until packet is delivered
+						if (Pack == NULL) Pack = RxPool.Alloc();
+						//frames held by IrRecvFrameCallback consumers must not starve command replies
+						if (Pack == NULL) Pack = ReplyPool.Alloc();
+						if (Pack != NULL){
+							PacketIdx = ReportHdr->PacketIdx;
+							FragmCount = ReportHdr->FragmCount;
+							PackSize = 0;
+							LastFragmIdx = 1;
+						}
 					}
 				}
 				if (FragmCount){
 					FragmSize = ReportHdr->FragmSize + 2 - sizeof(TiqiaaUsbIr_Report2Header);
 					if ((PackSize + FragmSize) <= MaxUsbPacketSize){
-						memcpy(PackBuf + PackSize, FragmBuf + sizeof(TiqiaaUsbIr_Report2Header), FragmSize);
+						memcpy(Pack->Buf + PackSize, FragmBuf + sizeof(TiqiaaUsbIr_Report2Header), FragmSize);
 						PackSize += FragmSize;
-						if ((ReportHdr->FragmIdx == LastFragmIdx) && (PackSize > 6)){
-							if ((*((uint16_t *)(PackBuf)) == PackStartSign) && (*((uint16_t *)(PackBuf + PackSize - 2)) == PackEndSign)){
-								ProcessRecvPacket(PackBuf + 2, PackSize - 4);
+						if ((ReportHdr->FragmIdx == FragmCount) && (PackSize > 6)){
+							if ((*((uint16_t *)(Pack->Buf)) == PackStartSign) && (*((uint16_t *)(Pack->Buf + PackSize - 2)) == PackEndSign)){
+								Pack->Data = Pack->Buf + 2;
+								Pack->Size = PackSize - 4;
+								ProcessRecvPacket(Pack);
+								Pack->Release();
+								Pack = NULL;
 							}
+							FragmCount = 0;
 						}
 					} else {//buffer overflow - drop packet
+						TIQIAA_TRACE_INSTANT("PacketDropped", PacketIdx);
 						FragmCount = 0;
 					}
 				}
 			}
 		}
 	}
+	if (Pack != NULL) Pack->Release();
 }
 
 bool GetVidPidFromDevicePath(const char * dev_path, uint16_t * vid, uint16_t * pid){
@@ -21,6 +21,9 @@
 #include <winusb.h>
 #include <vector>
 #include <string>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 
 #pragma pack(1)
 
@@ -62,6 +65,124 @@ struct TqIrWriteData{
 
 #pragma pack()
 
+const int TiqiaaUsbIr_MaxPacketSize = 1024;
+const int TiqiaaUsbIr_PacketHeadroom = sizeof(TiqiaaUsbIr_Report2Header);
+
+//! Packet buffer from fixed-size pool owned by TiqiaaUsbIr
+//! Received IR frames are handed to IrRecvFrameCallback as ref-counted views into such buffer
+struct TiqiaaUsbIr_PacketBuf{
+	//! Frame data
+	uint8_t * Data;
+	//! Size of frame data
+	int Size;
+
+	//! Keep frame valid after callback returns, must be paired with Release()
+	void AddRef();
+	//! Drop reference, buffer returns to the pool on last release
+	void Release();
+
+	volatile LONG RefCount;
+	class TiqiaaUsbIr_PacketPool * Pool;
+	TiqiaaUsbIr_PacketBuf * NextFree;
+	uint8_t Buf[TiqiaaUsbIr_PacketHeadroom + TiqiaaUsbIr_MaxPacketSize];
+};
+
+//! Fixed-size pool of packet buffers, all memory is allocated on construction
+class TiqiaaUsbIr_PacketPool {
+	public:
+	TiqiaaUsbIr_PacketPool(int count);
+	~TiqiaaUsbIr_PacketPool();
+
+	//! Get buffer from pool
+	//! Return: buffer with one reference and Data pointing after headroom, NULL if pool is exhausted
+	TiqiaaUsbIr_PacketBuf * Alloc();
+
+	//! Return: number of Alloc() calls failed due to pool exhaustion
+	LONG GetMissCount();
+
+	private:
+	friend struct TiqiaaUsbIr_PacketBuf;
+	void Free(TiqiaaUsbIr_PacketBuf * buf);
+
+	CRITICAL_SECTION PoolCs;
+	TiqiaaUsbIr_PacketBuf * Bufs;
+	TiqiaaUsbIr_PacketBuf * FreeList;
+	volatile LONG MissCount;
+};
+
+//! Single-waiter completion of a keyed request, e.g. reply to a command
+//! State is one atomic word, so completion and cancel never race with arming, and a completion
+//! can only satisfy the request it was armed for. Waiter spins shortly, then blocks; completer takes
+//! the mutex only when waiter is blocked.
+class TiqiaaUsbIr_Completion {
+	public:
+	TiqiaaUsbIr_Completion();
+
+	//! Start waiting for completion
+	//! key: Request key, 0..0xFFFF
+	//! Return: true - success, false - previous request is still pending
+	bool Arm(uint32_t key);
+
+	//! Complete pending request, called by producer
+	//! key: Request key
+	//! Return: true - request with this key was pending, false - no such request
+	bool Complete(uint32_t key);
+
+	//! Wait for completion of pending request
+	//! timeout: Timeout for waiting, msec
+	//! Return: true - request was completed and is no longer pending, false - timeout expired
+	//! (request is still pending) or no request is pending
+	bool Wait(DWORD timeout);
+
+	//! Drop pending request and wake waiter
+	//! Return: true - request was pending, false - no request is pending
+	bool Cancel();
+
+	//! Return: true - request is pending
+	bool IsArmed();
+
+	//! Busy wait before blocking, nsec, 0 on single CPU
+	int64_t SpinTime;
+
+	private:
+	static const uint32_t StateArmed = 0x10000;
+	static const uint32_t StateDone = 0x20000;
+
+	std::atomic<uint32_t> State; //key | StateArmed | StateDone, 0 - idle
+	std::atomic<int> Sleepers;
+	std::mutex Mutex;
+	std::condition_variable Cond;
+
+	void Wake();
+};
+
+//! Held-button repeat timing statistics
+//! Periods are measured between USB write completions of frames on the host, not on-air; device side
+//! buffering and transmit start delay are not seen
+struct TiqiaaUsbIr_RepeatStats{
+	int FrameCount; //frames sent, including first full frame
+	double MeanPeriodUs; //between write completions
+	double MinPeriodUs;
+	double MaxPeriodUs;
+	double JitterUs; //standard deviation of write completion period
+	double MaxLateUs; //max delay of frame write completion after its deadline
+};
+
+//! Reply timeout and retry policy
+struct TiqiaaUsbIr_RetryPolicy{
+	int CmdRetries; //retries of commands
+	int IrRetries; //retries of IR send, signal is transmitted twice if only reply was lost
+	DWORD MinTimeout; //msec
+	DWORD MaxTimeout; //msec, on top of signal duration
+};
+
+//! Smoothed reply round-trip time, excluding signal duration
+struct TiqiaaUsbIr_RttEstimate{
+	int64_t Srtt; //nsec
+	int64_t RttVar; //nsec
+	int SampleCount;
+};
+
 //send tick = 16mks, freq = 36700 hz 36.64 meas
 
 const int TiqiaaUsbIr_IrFreqTableSize = 30;
@@ -70,14 +191,13 @@ const int TiqiaaUsbIr_IrFreqTable[TiqiaaUsbIr_IrFreqTableSize] = {
 37700, 38380, 38400, 38462, 38740, 39200, 42000, 43600, 44000, 33000,
 33500, 34000, 34500, 35000, 40500, 41000, 41500, 42500, 43000, 45000};
 
+class TiqiaaUsbTraceWriter;
+
 typedef void TiqiaaUsbIr_IrRecvCallback(uint8_t * data, int size, class TiqiaaUsbIr * IrCls, void * context);
+typedef void TiqiaaUsbIr_IrRecvFrameCallback(TiqiaaUsbIr_PacketBuf * frame, class TiqiaaUsbIr * IrCls, void * context);
 
 class TiqiaaUsbIr {
-	private:
-	static const uint16_t DeviceVid1 = 0x10C4;
-	static const uint16_t DeviceVid2 = 0x45E;
-	static const uint16_t DevicePid = 0x8468;
-
+	public:
 	static const uint8_t CmdUnknown = 'H';
 	static const uint8_t CmdVersion = 'V';
 	static const uint8_t CmdIdleMode = 'L';
@@ -91,8 +211,9 @@ class TiqiaaUsbIr {
 	static const uint8_t StateSend = 9;
 	static const uint8_t StateRecv = 19;
 
+	protected:
 	static const int MaxUsbFragmSize = 56;
-	static const int MaxUsbPacketSize = 1024;
+	static const int MaxUsbPacketSize = TiqiaaUsbIr_MaxPacketSize;
 	static const int MaxUsbPacketIndex = 15;
 	static const int MaxCmdId = 0x7F;
 	static const uint16_t PackStartSign = 'TS'; //"ST"
@@ -101,37 +222,75 @@ class TiqiaaUsbIr {
 	static const UCHAR ReadPipeId = 0x81;
 	static const uint8_t WriteReportId = 2;
 	static const uint8_t ReadReportId = 1;
-	static const DWORD CmdReplyWaitTimeout = 500;
-	static const DWORD IrReplyWaitTimeout = 2000;
+	static const int ReportSize = 61;
+
+	private:
+	static const uint16_t DeviceVid1 = 0x10C4;
+	static const uint16_t DeviceVid2 = 0x45E;
+	static const uint16_t DevicePid = 0x8468;
+
+	static const DWORD CmdReplyWaitTimeout = 500; //until first RTT sample
+	static const DWORD IrReplyWaitTimeout = 2000; //until first RTT sample, on top of signal duration
+	static const int RttSlotCount = 8;
 
 	static const int NecPulseSize = 1125; //562.5 mks
 	static const int IrSendTickSize = 32; //16 mks
 	static const int MaxIrSendBlockSize = 127; //ticks
+	static const int NecFrameTailPulses = 72; //trailing space up to 108 ms frame period
+	static const int NecRepeatFrameTailPulses = 171; //trailing space up to 108 ms frame period
+	static const int NecRepeatTailPulses = 8; //trailing space of frames sent by repeat thread
+	static const int64_t NecRepeatPeriod = 108000000; //nsec
+	static const int64_t RepeatSpinTime = 1000000; //nsec, busy wait before deadline
+
+	static const int TxPoolSize = 4;
+	static const int RxPoolSize = 8;
+	static const int ReplyPoolSize = 1; //reserve for replies when frames held by callbacks exhaust RxPool
 
 	HANDLE DevHandle;
 	WINUSB_INTERFACE_HANDLE DevWinUsbHandle;
+	bool DevOpen;
 	HANDLE ReadThreadHandle;
 	DWORD ReadThreadId;
 	bool ReadActive;
 	uint8_t DeviceState;
-	CRITICAL_SECTION WaitCmdCs;
-	HANDLE WaitCmdEvent;
+	TiqiaaUsbIr_Completion CmdReply;
 
 	uint8_t PacketIndex;
 	uint8_t CmdId;
-	bool IsWaitingCmdReply;
-	bool IsCmdReplyReceived;
-	uint8_t WaitCmdId;
-	uint8_t WaitCmdType;
+
+	CRITICAL_SECTION WriteCs;
+	HANDLE RepeatThreadHandle;
+	HANDLE RepeatStopEvent;
+	volatile bool RepeatActive;
+	uint16_t RepeatIrCode;
+	CRITICAL_SECTION RepeatStatsCs;
+	TiqiaaUsbIr_RepeatStats RepeatStats;
+
+	TiqiaaUsbIr_PacketPool TxPool;
+	TiqiaaUsbIr_PacketPool RxPool;
+	TiqiaaUsbIr_PacketPool ReplyPool;
+
+	TiqiaaUsbIr_RttEstimate CmdRtt[RttSlotCount];
 
 	public:
 
+	//! Reply timeouts and retries, can be changed at any time
+	TiqiaaUsbIr_RetryPolicy RetryPolicy;
+
 	//! Callback function for received IR signal
 	TiqiaaUsbIr_IrRecvCallback * IrRecvCallback;
 
 	//! Pointer to any user data that will be passed to IrRecvCallback
 	void * IrRecvCbContext;
 
+	//! Callback function for received IR signal, frame is a view into pooled buffer
+	//! Frame is valid until callback returns, call frame->AddRef() to keep it longer
+	//! While held frames exhaust the pool, further IR frames are dropped, command replies are still processed
+	TiqiaaUsbIr_IrRecvFrameCallback * IrRecvFrameCallback;
+
+	//! Optional recorder of all USB reports, should be set before Open
+	TiqiaaUsbTraceWriter * TrafficRecorder;
+
 	//! Enumerate devices
 	//! DevList: List of detected devices
 	//! Return: true - success, false - fail
@@ -143,6 +302,31 @@ class TiqiaaUsbIr {
 	//! Return: size of signal data
 	static int WriteIrNecSignal(uint16_t IrCode, uint8_t * OutBuf);
 
+	//! Convert NEC repeat code to Tiqiaa signal data
+	//! OutBuf: Buffer for signal data, >= 64 bytes
+	//! Return: size of signal data
+	static int WriteIrNecRepeatSignal(uint8_t * OutBuf);
+
+	//! Return: monotonic high-resolution timestamp, nsec
+	static int64_t GetTimeNs();
+
+	//! Map carrier freq to freq ID
+	//! freq: 0..255 - direct freq ID, other - freq in HZ
+	//! Return: freq ID of nearest TiqiaaUsbIr_IrFreqTable value, -1 - invalid freq
+	static int GetIrFreqId(int freq);
+
+	//! Calculate on-air duration of signal data
+	//! buffer: IR signal data
+	//! buf_size: size of buffer
+	//! Return: duration, nsec
+	static int64_t GetIrSignalDuration(const void * buffer, int buf_size);
+
+	//! Read signal data file (as written by ir-usb -r, *.bin)
+	//! path: File path
+	//! data: Output signal data
+	//! Return: true - success, false - unable to read, empty or longer than TiqiaaUsbIr_MaxPacketSize file
+	static bool ReadIrSignalFile(const char * path, std::vector<uint8_t> &data);
+
 	TiqiaaUsbIr();
 	virtual ~TiqiaaUsbIr();
 
@@ -165,7 +349,7 @@ class TiqiaaUsbIr {
 	bool SendCmd(uint8_t cmdType, uint8_t cmdId);
 
 	//! Send IR data to device and return immideately
-	//! freq: Carrier freq - 0..255 - direct freq ID (index of TiqiaaUsbIr_IrFreqTable), one of TiqiaaUsbIr_IrFreqTable values - freq in HZ
+	//! freq: Carrier freq - 0..255 - direct freq ID (index of TiqiaaUsbIr_IrFreqTable), other - freq in HZ, nearest supported one is used
 	//! buffer: IR signal data
 	//! buf_size: size of buffer
 	//! cmdId: Command ID, can be obtained by GetCmdId()
@@ -195,6 +379,23 @@ class TiqiaaUsbIr {
 	//! Return: true - success, false - fail
 	bool CancelCmdReplyWaiting();
 
+	//! Send command to device and wait for completion, retry according to RetryPolicy
+	//! cmdType: Command type, one of Cmd* constant
+	//! Return: true - success, false - fail
+	//! Note: Timeout is derived from measured reply RTT, each attempt uses new command ID
+	bool SendCmdAndWaitReply(uint8_t cmdType);
+
+	//! Get timeout for waiting reply
+	//! cmdType: Command type of reply, one of Cmd* constant
+	//! duration: On-air duration of sent signal, nsec
+	//! Return: Timeout, msec
+	DWORD GetReplyTimeout(uint8_t cmdType, int64_t duration);
+
+	//! Get RTT estimate for command type
+	//! cmdType: Command type of reply, one of Cmd* constant
+	//! rtt: Output estimate
+	void GetRttEstimate(uint8_t cmdType, TiqiaaUsbIr_RttEstimate * rtt);
+
 	//! Get command ID for next command
 	//! Return: Command ID
 	uint8_t GetCmdId();
@@ -203,12 +404,17 @@ class TiqiaaUsbIr {
 	//! Return: true - success, false - fail
 	bool SetIdleMode();
 
+	//! Switch device to Send mode
+	//! Return: true - success, false - fail
+	bool SetSendMode();
+
 	//! Send IR data to device and wait for completion
-	//! freq: Carrier freq - 0..255 - direct freq ID, one of TiqiaaUsbIr_IrFreqTable values - freq in HZ
+	//! freq: Carrier freq - 0..255 - direct freq ID, other - freq in HZ, nearest supported one is used
 	//! buffer: IR signal data
 	//! buf_size: size of buffer
 	//! Return: true - success, false - fail
-	//! Note: This function will switch device to Send mode
+	//! Note: This function will switch device to Send mode;
+	//! Reply timeout is signal duration plus measured RTT, send is retried RetryPolicy.IrRetries times
 	bool SendIR(int freq, void * buffer, int buf_size);
 
 	//! Start receiving of IR signal
@@ -226,13 +432,44 @@ class TiqiaaUsbIr {
 	//! Note: This function will switch device to Send mode
 	bool SendNecSignal(uint16_t IrCode);
 
+	//! Start emulating held button: send NEC IR code once, then NEC repeat frames every 108 ms
+	//! IrCode: NEC IR code
+	//! Return: true - success, false - fail
+	//! Note: This function will switch device to Send mode;
+	//! Frames are sent from background thread without waiting for CmdOutput reply, the next frame is written ahead of its deadline by measured USB write latency;
+	//! Other send/receive functions should not be used until StopRepeat;
+	//! Repeat thread stops on its own on write failure, it's reaped by next StartRepeat or StopRepeat
+	bool StartRepeat(uint16_t IrCode);
+
+	//! Stop sending NEC repeat frames
+	//! Return: true - success, false - repeat was not active
+	bool StopRepeat();
+
+	//! Get timing statistics of current or last repeat
+	//! stats: Output statistics
+	void GetRepeatStats(TiqiaaUsbIr_RepeatStats * stats);
+
+	protected:
+	//! Device transport, can be overridden to work without WinUSB device
+	virtual bool OpenTransport(const char * device_path);
+	virtual void CloseTransport();
+	virtual bool WriteReport(uint8_t * data, int size);
+	virtual bool ReadReport(uint8_t * data, int size, ULONG * rx_size);
+	virtual void AbortRead();
+
 	private:
 	static DWORD WINAPI RunReadThreadFn(TiqiaaUsbIr * cls);
+	static int GetRttSlot(uint8_t cmdType);
+	void UpdateRtt(uint8_t cmdType, int64_t rtt);
+	static DWORD WINAPI RunRepeatThreadFn(TiqiaaUsbIr * cls);
 	static void WriteIrNecSignalPulse(TqIrWriteData * IrWrData, int PulseCount, bool isSet);
+	static int WriteIrNecFrame(uint16_t IrCode, uint8_t * OutBuf, int TailPulseCount);
+	static int WriteIrNecRepeatFrame(uint8_t * OutBuf, int TailPulseCount);
 
-	bool SendReport2(void * data, int size);
-	void ProcessRecvPacket(uint8_t * data, int size);
+	bool SendReport2(TiqiaaUsbIr_PacketBuf * pack);
+	void ProcessRecvPacket(TiqiaaUsbIr_PacketBuf * pack);
 	void ReadThreadFn();
+	void RepeatThreadFn();
 };
 
 #endif
@@ -0,0 +1,253 @@
+/*
+ * Recording and replay of Tiqiaa Tview USB traffic
+ */
+
+#include "TiqiaaUsbTrace.h"
+
+static const char TraceMagic[4] = {'T', 'Q', 'U', 'T'};
+
+TiqiaaUsbTraceWriter::TiqiaaUsbTraceWriter(){
+	File = NULL;
+	LastTime = 0;
+	InitializeCriticalSection(&WriteCs);
+}
+
+TiqiaaUsbTraceWriter::~TiqiaaUsbTraceWriter(){
+	Close();
+	DeleteCriticalSection(&WriteCs);
+}
+
+bool TiqiaaUsbTraceWriter::Open(const char * path){
+	uint32_t Ver = Version;
+
+	if (IsOpen()) return false;
+	File = fopen(path, "wb");
+	if (File == NULL) return false;
+	setvbuf(File, NULL, _IOFBF, 65536);
+	fwrite(TraceMagic, 1, sizeof(TraceMagic), File);
+	fwrite(&Ver, 1, sizeof(Ver), File);
+	LastTime = TiqiaaUsbIr::GetTimeNs();
+	return true;
+}
+
+void TiqiaaUsbTraceWriter::Close(){
+	EnterCriticalSection(&WriteCs);
+	if (File != NULL){
+		fclose(File);
+		File = NULL;
+	}
+	LeaveCriticalSection(&WriteCs);
+}
+
+bool TiqiaaUsbTraceWriter::IsOpen(){
+	return (File != NULL);
+}
+
+void TiqiaaUsbTraceWriter::WriteReport(uint8_t dir, int64_t time, const uint8_t * data, int size){
+	uint8_t Hdr[12];
+	int HdrSize = 0;
+	uint64_t Delta;
+
+	if ((size < 0) || (size > (int)sizeof(((TiqiaaUsbTraceRecord *)0)->Data))) return;
+	EnterCriticalSection(&WriteCs);
+	if (File != NULL){
+		//reports from read and write threads can be stamped slightly out of order
+		Delta = (time > LastTime) ? (time - LastTime) : 0;
+		if (time > LastTime) LastTime = time;
+		do {
+			Hdr[HdrSize] = Delta & 0x7F;
+			Delta >>= 7;
+			if (Delta != 0) Hdr[HdrSize] |= 0x80;
+			HdrSize ++;
+		} while (Delta != 0);
+		Hdr[HdrSize++] = (dir << 7) | size;
+		fwrite(Hdr, 1, HdrSize, File);
+		fwrite(data, 1, size, File);
+	}
+	LeaveCriticalSection(&WriteCs);
+}
+
+bool TiqiaaUsbTraceWriter::Load(const char * path, std::vector<TiqiaaUsbTraceRecord> &Records){
+	TiqiaaUsbTraceRecord Rec;
+	char Magic[4];
+	uint32_t Ver;
+	uint64_t Delta;
+	int Shift;
+	int c;
+	FILE * f;
+
+	f = fopen(path, "rb");
+	if (f == NULL) return false;
+	if ((fread(Magic, 1, sizeof(Magic), f) != sizeof(Magic)) || (memcmp(Magic, TraceMagic, sizeof(Magic)) != 0) ||
+		(fread(&Ver, 1, sizeof(Ver), f) != sizeof(Ver)) || (Ver != Version)){
+		fclose(f);
+		return false;
+	}
+	Records.clear();
+	Rec.Time = 0;
+	for (;;){
+		Delta = 0;
+		Shift = 0;
+		do {
+			c = fgetc(f);
+			if (c == EOF) break;
+			Delta |= (uint64_t)(c & 0x7F) << Shift;
+			Shift += 7;
+		} while ((c & 0x80) && (Shift < 64));
+		if (c == EOF) break;
+		c = fgetc(f);
+		if (c == EOF) break;
+		Rec.Time += Delta;
+		Rec.Dir = (c >> 7) & 1;
+		Rec.Size = c & 0x7F;
+		if ((Rec.Size > sizeof(Rec.Data)) || (fread(Rec.Data, 1, Rec.Size, f) != Rec.Size)) break;
+		Records.push_back(Rec);
+	}
+	fclose(f);
+	return true;
+}
+
+TiqiaaReplayUsbIr::TiqiaaReplayUsbIr(){
+	InitializeCriticalSection(&ReplayCs);
+	ReplayEvent = CreateEvent(NULL, false, false, NULL);
+	ReplayTimer = CreateWaitableTimerExA(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+	if (ReplayTimer == NULL) ReplayTimer = CreateWaitableTimerA(NULL, FALSE, NULL); //high resolution timer requires Windows 10 1803
+	Speed = 1;
+	NextRecord = 0;
+	HostWriteCount = 0;
+	ReadAborted = false;
+	AnchorTime = 0;
+	AnchorRecordTime = 0;
+	ReplayCount = 0;
+	ReplayBytes = 0;
+	FirstReplayTime = 0;
+	LastReplayTime = 0;
+}
+
+TiqiaaReplayUsbIr::~TiqiaaReplayUsbIr(){
+	//base destructor can't reach overridden transport
+	Close();
+	CloseHandle(ReplayEvent);
+	if (ReplayTimer != NULL) CloseHandle(ReplayTimer);
+	DeleteCriticalSection(&ReplayCs);
+}
+
+bool TiqiaaReplayUsbIr::LoadTrace(const char * path){
+	size_t i;
+	int OutCount = 0;
+
+	if (IsOpen()) return false;
+	if (!TiqiaaUsbTraceWriter::Load(path, Records)) return false;
+	OutBefore.resize(Records.size());
+	OutTimes.clear();
+	for (i = 0; i < Records.size(); i++){
+		OutBefore[i] = OutCount;
+		if (Records[i].Dir == TiqiaaUsbTrace_DirOut){
+			OutTimes.push_back(Records[i].Time);
+			OutCount ++;
+		}
+	}
+	return true;
+}
+
+void TiqiaaReplayUsbIr::GetReplayStats(int * count, int64_t * bytes, int64_t * elapsed){
+	EnterCriticalSection(&ReplayCs);
+	*count = ReplayCount;
+	*bytes = ReplayBytes;
+	*elapsed = LastReplayTime - FirstReplayTime;
+	LeaveCriticalSection(&ReplayCs);
+}
+
+bool TiqiaaReplayUsbIr::OpenTransport(const char * device_path){
+	EnterCriticalSection(&ReplayCs);
+	NextRecord = 0;
+	HostWriteCount = 0;
+	ReadAborted = false;
+	AnchorTime = GetTimeNs();
+	AnchorRecordTime = 0;
+	ReplayCount = 0;
+	ReplayBytes = 0;
+	FirstReplayTime = 0;
+	LastReplayTime = 0;
+	LeaveCriticalSection(&ReplayCs);
+	return true;
+}
+
+void TiqiaaReplayUsbIr::CloseTransport(){
+}
+
+void TiqiaaReplayUsbIr::AbortRead(){
+	EnterCriticalSection(&ReplayCs);
+	ReadAborted = true;
+	SetEvent(ReplayEvent);
+	LeaveCriticalSection(&ReplayCs);
+}
+
+bool TiqiaaReplayUsbIr::WriteReport(uint8_t * data, int size){
+	EnterCriticalSection(&ReplayCs);
+	//device replies are timed relative to the host report that caused them
+	if (HostWriteCount < (int)OutTimes.size()){
+		AnchorTime = GetTimeNs();
+		AnchorRecordTime = OutTimes[HostWriteCount];
+	}
+	HostWriteCount ++;
+	SetEvent(ReplayEvent);
+	LeaveCriticalSection(&ReplayCs);
+	return true;
+}
+
+void TiqiaaReplayUsbIr::WaitReplay(int64_t time){
+	LARGE_INTEGER DueTime;
+	HANDLE Handles[2] = {ReplayEvent, ReplayTimer};
+
+	//host report or abort ends the wait early, they can change or cancel due time
+	if (ReplayTimer != NULL){
+		DueTime.QuadPart = -(time / 100);
+		if (SetWaitableTimer(ReplayTimer, &DueTime, 0, NULL, NULL, FALSE)){
+			WaitForMultipleObjects(2, Handles, FALSE, INFINITE);
+			return;
+		}
+	}
+	WaitForSingleObject(ReplayEvent, (DWORD)(time / 1000000 + 1));
+}
+
+bool TiqiaaReplayUsbIr::ReadReport(uint8_t * data, int size, ULONG * rx_size){
+	TiqiaaUsbTraceRecord * Rec;
+	int64_t Now;
+	int64_t DueTime;
+	int64_t WaitTime;
+
+	for (;;){
+		WaitTime = -1; //no report is ready to be due, wait for host report
+		EnterCriticalSection(&ReplayCs);
+		if (ReadAborted){
+			LeaveCriticalSection(&ReplayCs);
+			return false;
+		}
+		while ((NextRecord < Records.size()) && (Records[NextRecord].Dir != TiqiaaUsbTrace_DirIn)) NextRecord ++;
+		if ((NextRecord < Records.size()) && (HostWriteCount >= OutBefore[NextRecord])){
+			Rec = &Records[NextRecord];
+			Now = GetTimeNs();
+			DueTime = Now;
+			if (Speed > 0) DueTime = AnchorTime + (int64_t)((Rec->Time - AnchorRecordTime) / Speed);
+			if (DueTime <= Now){
+				if (size > Rec->Size) size = Rec->Size;
+				memcpy(data, Rec->Data, size);
+				*rx_size = size;
+				NextRecord ++;
+				if (ReplayCount == 0) FirstReplayTime = Now;
+				LastReplayTime = Now;
+				ReplayCount ++;
+				ReplayBytes += size;
+				LeaveCriticalSection(&ReplayCs);
+				return true;
+			}
+			WaitTime = DueTime - Now;
+		}
+		LeaveCriticalSection(&ReplayCs);
+		//timer wakes SpinTime early, rest is busy waited by checking the report again
+		if (WaitTime < 0) WaitForSingleObject(ReplayEvent, INFINITE);
+		else if (WaitTime > SpinTime) WaitReplay(WaitTime - SpinTime);
+		else YieldProcessor();
+	}
+}
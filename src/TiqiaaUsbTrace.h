@@ -0,0 +1,131 @@
+/*
+ * Recording and replay of Tiqiaa Tview USB traffic
+ *
+ * Trace file format:
+ *
+ * Header: "TQUT", uint32_t version
+ * Record: varint time delta from previous record (or trace start), nsec
+ *         uint8_t direction << 7 | report size
+ *         report data
+ *
+ * Example:
+ *
+ * TiqiaaUsbTraceWriter Trace;
+ * Trace.Open("session.trace");
+ * TiqiaaUsbIr Ir;
+ * Ir.TrafficRecorder = &Trace;
+ * Ir.Open(IrDev[0].c_str());
+ * ...
+ * Ir.Close();
+ *
+ * TiqiaaReplayUsbIr Replay;
+ * Replay.LoadTrace("session.trace");
+ * Replay.Open("replay");
+ * ...
+ */
+
+#ifndef TIQIAA_USB_TRACE_H
+#define TIQIAA_USB_TRACE_H
+
+#include "TiqiaaUsb.h"
+#include <stdio.h>
+
+const uint8_t TiqiaaUsbTrace_DirOut = 0; //host to device
+const uint8_t TiqiaaUsbTrace_DirIn = 1; //device to host
+
+struct TiqiaaUsbTraceRecord{
+	int64_t Time; //nsec from trace start
+	uint8_t Dir;
+	uint8_t Size;
+	uint8_t Data[64];
+};
+
+class TiqiaaUsbTraceWriter {
+	private:
+	static const uint32_t Version = 1;
+
+	FILE * File;
+	CRITICAL_SECTION WriteCs;
+	int64_t LastTime;
+
+	public:
+	TiqiaaUsbTraceWriter();
+	virtual ~TiqiaaUsbTraceWriter();
+
+	//! Create trace file
+	//! path: Path to trace file
+	//! Return: true - success, false - fail
+	bool Open(const char * path);
+
+	//! Flush and close trace file
+	void Close();
+
+	//! Return: true - trace file is open
+	bool IsOpen();
+
+	//! Append report to trace
+	//! dir: TiqiaaUsbTrace_DirOut or TiqiaaUsbTrace_DirIn
+	//! time: Timestamp from TiqiaaUsbIr::GetTimeNs()
+	//! data: Report data
+	//! size: Report size, <= 64
+	void WriteReport(uint8_t dir, int64_t time, const uint8_t * data, int size);
+
+	//! Load whole trace file
+	//! path: Path to trace file
+	//! Records: Output records
+	//! Return: true - success, false - fail
+	static bool Load(const char * path, std::vector<TiqiaaUsbTraceRecord> &Records);
+};
+
+class TiqiaaReplayUsbIr : public TiqiaaUsbIr {
+	private:
+	static const int64_t SpinTime = 1000000; //nsec, busy wait before report is due
+
+	std::vector<TiqiaaUsbTraceRecord> Records;
+	std::vector<int> OutBefore; //number of host reports preceding each record
+	std::vector<int64_t> OutTimes; //time of each host report
+	size_t NextRecord;
+	int HostWriteCount;
+	int64_t AnchorTime;
+	int64_t AnchorRecordTime;
+	bool ReadAborted;
+	CRITICAL_SECTION ReplayCs;
+	HANDLE ReplayEvent;
+	HANDLE ReplayTimer;
+
+	int ReplayCount;
+	int64_t ReplayBytes;
+	int64_t FirstReplayTime;
+	int64_t LastReplayTime;
+
+	void WaitReplay(int64_t time);
+
+	public:
+	//! Replay speed: 1 - original timing, 10 - 10 times faster, 0 - no pacing
+	double Speed;
+
+	TiqiaaReplayUsbIr();
+	virtual ~TiqiaaReplayUsbIr();
+
+	//! Load trace to replay, should be called before Open
+	//! path: Path to trace file
+	//! Return: true - success, false - fail
+	bool LoadTrace(const char * path);
+
+	//! Get replay statistics
+	//! count: Number of reports passed to host
+	//! bytes: Size of reports passed to host
+	//! elapsed: Time between first and last report, nsec
+	void GetReplayStats(int * count, int64_t * bytes, int64_t * elapsed);
+
+	protected:
+	//! Device reports are delivered in trace order, each one not earlier than
+	//! host has written as many reports as preceded it in the trace
+	virtual bool OpenTransport(const char * device_path);
+	virtual void CloseTransport();
+	virtual bool WriteReport(uint8_t * data, int size);
+	virtual bool ReadReport(uint8_t * data, int size, ULONG * rx_size);
+	virtual void AbortRead();
+};
+
+#endif
@@ -1,37 +1,783 @@
 #include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <chrono>
+#include <algorithm>
 #include <thread>
+#include <atomic>
 
 #include "getopt.h"
 #include "TiqiaaUsb.h"
+#include "TiqiaaFakeUsb.h"
+#include "TiqiaaUsbTrace.h"
+#include "IrSequencer.h"
+#include "IrBatch.h"
+#include "IrMatchIndex.h"
+#include "IrCodeReader.h"
+#include "IrLoopback.h"
+#include "TiqiaaEventTrace.h"
 
 static FILE *io_file = NULL;
 static bool signal_received;
+static IrMatchIndex *match_index = NULL;
 
 static void test_callback(uint8_t* data, int size, TiqiaaUsbIr* IrCls, void* context)
 {
     printf("INFO: Received data %d\n", size);
     fwrite(data, sizeof(char), size, io_file);
     fclose(io_file);
+    if (match_index)
+    {
+        IrSignal Signal;
+        IrMatchResult Match;
+        int64_t start = TiqiaaUsbIr::GetTimeNs();
+        bool found = Signal.DecodeBlocks(data, size) && match_index->Find(Signal, &Match);
+        double lookup_us = (TiqiaaUsbIr::GetTimeNs() - start) / 1000.0;
+        if (found)
+            printf("INFO: Nearest match %s%s, mean edge error %u us (%d candidates, %.1f us)\n", match_index->GetName(Match.Index).c_str(),
+                   Match.InTolerance ? "" : " (out of tolerance)", Match.MeanError, Match.Candidates, lookup_us);
+        else
+            printf("INFO: No match in library (%.1f us)\n", lookup_us);
+    }
     signal_received = true;
 }
 
 static const char usage[] =
-    "Usage: ir-usb [-s file_path] [-r file_path] [-r|-s ...]\n"
+    "Usage: ir-usb [--trace trace_json] [-F drop_pct,delay_ms[,jitter_ms] | -P trace[,speed]] [-w trace] [-m library] [-s file_path[,freq]] [-r file_path] [-H nec_code,hold_ms] [-q timeline] [-r|-s|-H|-q ...]\n"
     "\n"
     "  -h   Show help message and quit\n"
+    "  --trace  Write driver event timeline to Chrome trace-event JSON file (chrome://tracing), must be the first option\n"
+    "  -F   Use simulated device which drops drop_pct%% of replies and delays them by delay_ms\n"
+    "  -P   Use device replaying recorded trace, speed 1 - original timing, 0 - as fast as possible\n"
+    "  -w   Record USB traffic to trace file\n"
+    "  -m   Look up received signals in signal library and print the nearest one\n"
     "  -r   Receive IR signal and store to file_path\n"
-    "  -s   Send IR signal from file_path\n";
+    "  -s   Send IR signal from file_path, carrier freq is 38000 Hz by default\n"
+    "  -H   Hold button: send NEC code, then NEC repeat frames for hold_ms\n"
+    "  -q   Play timeline of deadline-scheduled signals, per-event lateness CSV is written to stdout\n"
+    "\n"
+    "Usage: ir-usb --batch [-f library|lirc|pronto|broadlink] [-o out_path] [-j threads] [-c freq] dir [dir ...]\n"
+    "\n"
+    "  Convert all *.bin captures under dir to signal library, lircd.conf, Pronto hex or Broadlink base64\n"
+    "  -f   Output format, library by default\n"
+    "  -o   Output file, stdout by default\n"
+    "  -j   Number of threads, number of CPUs by default\n"
+    "  -c   Carrier freq of captures, 38000 by default\n"
+    "\n"
+    "Usage: ir-usb --match-bench [-n queries] [-t tolerance_pct] [entries ...]\n"
+    "\n"
+    "  Benchmark signal library lookup on synthetic libraries, 10000 100000 1000000 entries by default\n"
+    "\n"
+    "Usage: ir-usb --convert [-i in_format] [-f library|lirc|pronto|broadlink|bin] [-o out_path] file [file ...]\n"
+    "\n"
+    "  Convert code files between signal library, lircd.conf raw_codes, Pronto hex and Broadlink base64\n"
+    "  -i   Input format, detected by content by default\n"
+    "  -f   Output format, library by default; bin writes signal data for -s, one file per code to out_path directory\n"
+    "  -o   Output file or directory, stdout by default\n"
+    "\n"
+    "Usage: ir-usb --convert-bench [-n codes]\n"
+    "\n"
+    "  Benchmark code parsing and conversion to signal data for each format, 100000 codes by default\n"
+    "\n"
+    "Usage: ir-usb --loopback [-n repeats] [-i interval_ms] [-d tx,rx | -F stretch_us,jitter_us,delay_us] [code_file ...]\n"
+    "\n"
+    "  Send codes from one device to another, report receive latency and edge timing errors; a few NEC codes by default\n"
+    "  -n   Number of times each code is sent, 10 by default\n"
+    "  -i   Pause between transmits, 50 ms by default\n"
+    "  -d   Indexes of transmitting and receiving devices, 0,1 by default\n"
+    "  -F   Use two linked simulated devices, receiver stretches marks, adds edge jitter and reporting delay\n"
+    "  code_file  Signal data (*.bin) or code file of any --convert input format\n"
+    "\n"
+    "Usage: ir-usb --wake-bench [-n iterations] [delay_us ...]\n"
+    "\n"
+    "  Benchmark reply hand-off from read thread to waiting thread, reply lands delay_us after waiting starts;\n"
+    "  0 100 1000 us by default\n";
+
+static int parse_format(const char *name)
+{
+    if (strcmp(name, "library") == 0)
+        return IrSignal::FormatLibrary;
+    if (strcmp(name, "lirc") == 0)
+        return IrSignal::FormatLirc;
+    if (strcmp(name, "pronto") == 0)
+        return IrSignal::FormatPronto;
+    if (strcmp(name, "broadlink") == 0)
+        return IrSignal::FormatBroadlink;
+    return -1;
+}
+
+// "nec_code,hold_ms", hold time must be positive
+static bool parse_hold(const char *arg, unsigned long *code, long *hold_ms)
+{
+    char *end;
+    *code = strtoul(arg, &end, 0);
+    if( end == arg || *end != ',' || *code > 0xFFFF )
+        return false;
+    arg = end + 1;
+    *hold_ms = strtol(arg, &end, 0);
+    return end != arg && *end == 0 && *hold_ms > 0;
+}
+
+static bool hold_button(TiqiaaUsbIr &Ir, const char *arg)
+{
+    unsigned long code;
+    long hold_ms;
+    if( !parse_hold(arg, &code, &hold_ms) ) {
+        fprintf(stderr, "ERROR: Invalid hold argument: %s\n", arg);
+        return false;
+    }
+
+    fprintf(stderr, "INFO: Holding NEC code 0x%04lx for %ld ms\n", code, hold_ms);
+    if( !Ir.StartRepeat((uint16_t)code) ) {
+        fprintf(stderr, "ERROR: Unable to start repeat\n");
+        return false;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(hold_ms));
+    Ir.StopRepeat();
+
+    TiqiaaUsbIr_RepeatStats stats;
+    Ir.GetRepeatStats(&stats);
+    fprintf(stderr, "INFO: Sent %d frames, USB write completion (not on-air) period mean %.1f us, min %.1f us, max %.1f us, jitter %.1f us, max late %.1f us\n",
+            stats.FrameCount, stats.MeanPeriodUs, stats.MinPeriodUs, stats.MaxPeriodUs, stats.JitterUs, stats.MaxLateUs);
+    return true;
+}
+
+static bool play_timeline(TiqiaaUsbIr &Ir, std::vector<std::string> &DevList, const char *path)
+{
+    IrSequencer Seq;
+    if( !Seq.Load(path) )
+        return false;
+
+    // Timeline may target several devices, the first one is already opened
+    std::vector<TiqiaaUsbIr*> Devices;
+    bool res = true;
+    Devices.push_back(&Ir);
+    for( size_t i = 0; i < Seq.Events.size() && res; i++ ) {
+        while( (size_t)Seq.Events[i].Device >= Devices.size() && Devices.size() < DevList.size() ) {
+            TiqiaaUsbIr *Dev = new TiqiaaUsbIr();
+            if( !Dev->Open(DevList[Devices.size()].c_str()) ) {
+                fprintf(stderr, "ERROR: Unable to open device %u: %s\n", (unsigned)Devices.size(), DevList[Devices.size()].c_str());
+                delete Dev;
+                res = false;
+                break;
+            }
+            Devices.push_back(Dev);
+        }
+    }
+
+    if( res ) {
+        fprintf(stderr, "INFO: Playing %u events from %s\n", (unsigned)Seq.Events.size(), path);
+        res = Seq.Run(Devices);
+        if( !res )
+            fprintf(stderr, "ERROR: Timeline playback failed\n");
+        Seq.WriteStats(stdout);
+    }
+
+    for( size_t i = 1; i < Devices.size(); i++ ) {
+        Devices[i]->Close();
+        delete Devices[i];
+    }
+    return res;
+}
+
+static int run_batch(int argc, char *argv[])
+{
+    IrBatch Batch;
+    const char *out_path = NULL;
+    int c;
+
+    while ((c = getopt(argc, argv, "f:o:j:c:")) != -1)
+    {
+        switch (c)
+        {
+            case 'f':
+                Batch.OutputFormat = parse_format(optarg);
+                if (Batch.OutputFormat < 0) {
+                    fprintf(stderr, "ERROR: Unknown format %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'o':
+                out_path = optarg;
+                break;
+            case 'j':
+                Batch.ThreadCount = atoi(optarg);
+                break;
+            case 'c':
+                Batch.Freq = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "%s", usage);
+                return 1;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "%s", usage);
+        return 1;
+    }
+
+    for (int i = optind; i < argc; i++)
+        fprintf(stderr, "INFO: Found %d captures in %s\n", Batch.AddDirectory(argv[i]), argv[i]);
+
+    FILE *out = out_path ? fopen(out_path, "wb") : stdout;
+    if (!out) {
+        fprintf(stderr, "ERROR: Unable to open output file %s\n", out_path);
+        return 1;
+    }
+    bool res = Batch.Run(out);
+    if (out != stdout)
+        fclose(out);
+    Batch.WriteStats(stderr);
+    return res ? 0 : 1;
+}
+
+static uint32_t bench_random(uint32_t &seed)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+// Synthetic pulse distance codes: header, bits, stop mark; timings vary per entry by +-3%
+static void make_bench_signal(IrSignal &Signal, uint32_t &seed, int protocol)
+{
+    static const uint32_t timings[][6] = {
+        // hdr mark, hdr space, bit mark, zero space, one space, bits
+        { 9000, 4500, 560, 560, 1690, 32 }, // NEC
+        { 4500, 4500, 560, 560, 1690, 32 }, // Samsung
+        { 3500, 1750, 435, 435, 1300, 48 }, // Panasonic
+        { 8400, 4200, 525, 525, 1575, 32 }, // JVC-like
+    };
+    const uint32_t *t = timings[protocol % 4];
+    uint32_t scale;
+
+    scale = 970 + bench_random(seed) % 61;
+    Signal.Durations.clear();
+    Signal.Durations.push_back(t[0] * scale / 1000);
+    Signal.Durations.push_back(t[1] * scale / 1000);
+    for (uint32_t i = 0; i < t[5]; i++) {
+        Signal.Durations.push_back(t[2] * scale / 1000);
+        Signal.Durations.push_back(t[(bench_random(seed) & 1) ? 4 : 3] * scale / 1000);
+    }
+    Signal.Durations.push_back(t[2] * scale / 1000);
+    Signal.Durations.push_back(40000);
+}
+
+static int run_match_bench(int argc, char *argv[])
+{
+    std::vector<int> sizes;
+    int queries = 10000;
+    int tolerance = 25;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:t:")) != -1)
+    {
+        switch (c)
+        {
+            case 'n':
+                queries = atoi(optarg);
+                break;
+            case 't':
+            {
+                char *end;
+                tolerance = (int)strtol(optarg, &end, 10);
+                if (end == optarg || *end != 0 || tolerance < 0 || tolerance > IrMatchIndex::MaxTolerance)
+                {
+                    fprintf(stderr, "ERROR: Tolerance must be 0..%d percent: %s\n", IrMatchIndex::MaxTolerance, optarg);
+                    fprintf(stderr, "%s", usage);
+                    return 1;
+                }
+                break;
+            }
+            default:
+                fprintf(stderr, "%s", usage);
+                return 1;
+        }
+    }
+    for (int i = optind; i < argc; i++)
+        sizes.push_back(atoi(argv[i]));
+    if (sizes.empty()) {
+        sizes.push_back(10000);
+        sizes.push_back(100000);
+        sizes.push_back(1000000);
+    }
+    if (queries <= 0)
+        queries = 1;
+
+    printf("entries,build_ms,memory_mb,mean_us,p50_us,p99_us,max_us,mean_candidates,exact_pct,in_tolerance_pct\n");
+    for (size_t n = 0; n < sizes.size(); n++) {
+        IrMatchIndex Index;
+        IrSignal Signal;
+        char name[16];
+        uint32_t seed = 1;
+
+        // Queries are random library entries, captured while the library is generated
+        std::vector<std::pair<int, int> > picks;
+        std::vector<IrSignal> samples(queries);
+        uint32_t qseed = 7;
+        for (int q = 0; q < queries; q++) {
+            picks.push_back(std::make_pair((int)(bench_random(qseed) % (uint32_t)sizes[n]), q));
+        }
+        std::sort(picks.begin(), picks.end());
+
+        Index.Tolerance = tolerance;
+        size_t next_pick = 0;
+        for (int i = 0; i < sizes[n]; i++) {
+            make_bench_signal(Signal, seed, i);
+            snprintf(name, sizeof(name), "s%d", i);
+            Index.Add(name, Signal);
+            for (; next_pick < picks.size() && picks[next_pick].first == i; next_pick++)
+                samples[picks[next_pick].second] = Signal;
+        }
+        int64_t start = TiqiaaUsbIr::GetTimeNs();
+        Index.Build();
+        double build_ms = (TiqiaaUsbIr::GetTimeNs() - start) / 1000000.0;
+
+        std::vector<int> entries(queries);
+        for (size_t i = 0; i < picks.size(); i++)
+            entries[picks[i].second] = picks[i].first;
+
+        // Receiver jitter of +-8% per edge
+        std::vector<int64_t> times;
+        int64_t candidates = 0;
+        int exact = 0, in_tolerance = 0;
+        for (int q = 0; q < queries; q++) {
+            IrSignal &Query = samples[q];
+            int entry = entries[q];
+            for (size_t e = 0; e < Query.Durations.size(); e++) {
+                Query.Durations[e] = (uint32_t)(Query.Durations[e] * (0.92 + (bench_random(qseed) % 161) / 1000.0));
+            }
+
+            IrMatchResult Match;
+            start = TiqiaaUsbIr::GetTimeNs();
+            bool found = Index.Find(Query, &Match);
+            times.push_back(TiqiaaUsbIr::GetTimeNs() - start);
+            candidates += Match.Candidates;
+            if (found && Match.Index == entry)
+                exact++;
+            if (found && Match.InTolerance)
+                in_tolerance++;
+        }
+        std::sort(times.begin(), times.end());
+        int64_t total = 0;
+        for (size_t i = 0; i < times.size(); i++)
+            total += times[i];
+        printf("%d,%.1f,%.1f,%.2f,%.2f,%.2f,%.2f,%.1f,%.2f,%.2f\n", sizes[n], build_ms, Index.GetMemorySize() / 1000000.0,
+               total / 1000.0 / queries, times[times.size() / 2] / 1000.0, times[times.size() * 99 / 100] / 1000.0, times.back() / 1000.0,
+               (double)candidates / queries, 100.0 * exact / queries, 100.0 * in_tolerance / queries);
+        fflush(stdout);
+    }
+    return 0;
+}
+
+static bool write_bin(const char *dir, const std::string &name, const IrSignal &Signal, std::vector<uint8_t> &blocks)
+{
+    std::string path = dir;
+    path += '/';
+    for (size_t i = 0; i < name.size(); i++)
+        path += (isalnum((unsigned char)name[i]) || name[i] == '-' || name[i] == '_') ? name[i] : '_';
+    path += ".bin";
+
+    Signal.EncodeBlocks(blocks);
+    if (blocks.size() > (size_t)TiqiaaUsbIr_MaxPacketSize)
+        fprintf(stderr, "WARNING: %s is %u bytes, longer than device packet\n", name.c_str(), (unsigned)blocks.size());
+    FILE *f = fopen(path.c_str(), "wb");
+    if (!f)
+        return false;
+    bool res = fwrite(blocks.data(), 1, blocks.size(), f) == blocks.size();
+    fclose(f);
+    return res;
+}
+
+static int run_convert(int argc, char *argv[])
+{
+    int in_format = IrCodeReader::FormatAuto;
+    int out_format = IrSignal::FormatLibrary;
+    bool out_bin = false;
+    const char *out_path = NULL;
+    int c;
+
+    while ((c = getopt(argc, argv, "i:f:o:")) != -1)
+    {
+        switch (c)
+        {
+            case 'i':
+                in_format = parse_format(optarg);
+                if (in_format < 0) {
+                    fprintf(stderr, "ERROR: Unknown format %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'f':
+                out_bin = strcmp(optarg, "bin") == 0;
+                out_format = out_bin ? IrSignal::FormatLibrary : parse_format(optarg);
+                if (out_format < 0) {
+                    fprintf(stderr, "ERROR: Unknown format %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'o':
+                out_path = optarg;
+                break;
+            default:
+                fprintf(stderr, "%s", usage);
+                return 1;
+        }
+    }
+    if (optind >= argc || (out_bin && !out_path)) {
+        fprintf(stderr, "%s", usage);
+        return 1;
+    }
+
+    FILE *out = NULL;
+    if (!out_bin) {
+        out = out_path ? fopen(out_path, "wb") : stdout;
+        if (!out) {
+            fprintf(stderr, "ERROR: Unable to open output file %s\n", out_path);
+            return 1;
+        }
+    }
+
+    IrCodeReader Reader;
+    IrSignal Signal;
+    std::string name;
+    std::string text;
+    std::vector<uint8_t> blocks;
+    int codes = 0, errors = 0, write_errors = 0;
+    int64_t bytes = 0;
+    int64_t start = TiqiaaUsbIr::GetTimeNs();
+
+    if (out_format == IrSignal::FormatLirc)
+        IrSignal::WriteLircHeader(text, "converted", IrSignal::DefaultFreq, IrSignal::DefaultMaxGap);
+    for (int i = optind; i < argc; i++) {
+        if (!Reader.Open(argv[i], in_format)) {
+            fprintf(stderr, "ERROR: Unable to open %s\n", argv[i]);
+            errors++;
+            continue;
+        }
+        while (Reader.Next(Signal, name)) {
+            if (out_bin) {
+                if (!write_bin(out_path, name, Signal, blocks))
+                    write_errors++;
+                continue;
+            }
+            Signal.Write(out_format, text, name.c_str());
+            if (out_format == IrSignal::FormatLirc)
+                text += '\n';
+            // Flush in large chunks, whole output is never held in memory
+            if (text.size() >= 65536) {
+                fwrite(text.data(), 1, text.size(), out);
+                text.clear();
+            }
+        }
+        codes += Reader.GetCodeCount();
+        errors += Reader.GetErrorCount();
+        bytes += Reader.GetSize();
+        Reader.Close();
+    }
+    if (out) {
+        if (out_format == IrSignal::FormatLirc)
+            IrSignal::WriteLircFooter(text);
+        fwrite(text.data(), 1, text.size(), out);
+        if (ferror(out))
+            write_errors++;
+        if (out != stdout)
+            fclose(out);
+    }
+
+    double sec = (TiqiaaUsbIr::GetTimeNs() - start) / 1000000000.0;
+    if (sec <= 0)
+        sec = 1e-9;
+    fprintf(stderr, "INFO: %d codes (%d malformed) from %.2f MB in %.3f s: %.0f codes/s, %.2f MB/s\n",
+            codes, errors, bytes / 1000000.0, sec, codes / sec, bytes / 1000000.0 / sec);
+    if (write_errors)
+        fprintf(stderr, "ERROR: %d codes were not written\n", write_errors);
+    return (errors || write_errors) ? 1 : 0;
+}
+
+static int run_convert_bench(int argc, char *argv[])
+{
+    static const char *names[] = { "library", "lirc", "pronto", "broadlink" };
+    int codes = 100000;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:")) != -1)
+    {
+        switch (c)
+        {
+            case 'n':
+                codes = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "%s", usage);
+                return 1;
+        }
+    }
+
+    printf("format,codes,bytes,write_ms,parse_ms,parse_codes_per_s,parse_mb_per_s,encode_ms,malformed\n");
+    for (int format = 0; format < 4; format++) {
+        IrSignal Signal;
+        std::string text;
+        std::string name;
+        std::vector<uint8_t> blocks;
+        char code_name[16];
+        uint32_t seed = 1;
+
+        int64_t start = TiqiaaUsbIr::GetTimeNs();
+        if (format == IrSignal::FormatLirc)
+            IrSignal::WriteLircHeader(text, "bench", IrSignal::DefaultFreq, IrSignal::DefaultMaxGap);
+        for (int i = 0; i < codes; i++) {
+            make_bench_signal(Signal, seed, i);
+            snprintf(code_name, sizeof(code_name), "c%d", i);
+            Signal.Write(format, text, code_name);
+        }
+        if (format == IrSignal::FormatLirc)
+            IrSignal::WriteLircFooter(text);
+        double write_ms = (TiqiaaUsbIr::GetTimeNs() - start) / 1000000.0;
+
+        IrCodeReader Reader;
+        int64_t encode_ns = 0;
+        start = TiqiaaUsbIr::GetTimeNs();
+        Reader.OpenBuffer(text.data(), text.size());
+        while (Reader.Next(Signal, name)) {
+            int64_t encode_start = TiqiaaUsbIr::GetTimeNs();
+            Signal.EncodeBlocks(blocks);
+            encode_ns += TiqiaaUsbIr::GetTimeNs() - encode_start;
+        }
+        double parse_ms = (TiqiaaUsbIr::GetTimeNs() - start - encode_ns) / 1000000.0;
+        if (parse_ms <= 0)
+            parse_ms = 1e-6;
+        if (Reader.Format != format || Reader.GetCodeCount() != codes)
+            fprintf(stderr, "ERROR: %s: detected format %d, %d codes read\n", names[format], Reader.Format, Reader.GetCodeCount());
+
+        printf("%s,%d,%u,%.1f,%.1f,%.0f,%.2f,%.1f,%d\n", names[format], Reader.GetCodeCount(), (unsigned)text.size(), write_ms, parse_ms,
+               Reader.GetCodeCount() / parse_ms * 1000, text.size() / 1000.0 / parse_ms, encode_ns / 1000000.0, Reader.GetErrorCount());
+        fflush(stdout);
+    }
+    return 0;
+}
+
+static int run_loopback(int argc, char *argv[])
+{
+    IrLoopback Loopback;
+    bool use_fake = false;
+    int fake_stretch_us = 0;
+    int fake_jitter_us = 0;
+    int fake_delay_us = 0;
+    int tx_index = 0;
+    int rx_index = 1;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:i:d:F:")) != -1)
+    {
+        switch (c)
+        {
+            case 'n':
+                Loopback.Repeats = atoi(optarg);
+                break;
+            case 'i':
+                Loopback.Interval = (DWORD)atoi(optarg);
+                break;
+            case 'd':
+                sscanf(optarg, "%d,%d", &tx_index, &rx_index);
+                break;
+            case 'F':
+                use_fake = true;
+                sscanf(optarg, "%d,%d,%d", &fake_stretch_us, &fake_jitter_us, &fake_delay_us);
+                break;
+            default:
+                fprintf(stderr, "%s", usage);
+                return 1;
+        }
+    }
+    for (int i = optind; i < argc; i++) {
+        int n = Loopback.LoadCodes(argv[i]);
+        if (n < 0) {
+            fprintf(stderr, "ERROR: Unable to read codes from %s\n", argv[i]);
+            return 1;
+        }
+        fprintf(stderr, "INFO: Loaded %d codes from %s\n", n, argv[i]);
+    }
+    if (Loopback.Codes.empty())
+        Loopback.AddDefaultCodes();
+
+    TiqiaaUsbIr RealTx, RealRx;
+    TiqiaaFakeUsbIr FakeTx, FakeRx;
+    TiqiaaUsbIr &Tx = use_fake ? FakeTx : RealTx;
+    TiqiaaUsbIr &Rx = use_fake ? FakeRx : RealRx;
+    if (use_fake) {
+        FakeTx.LinkMarkStretch = fake_stretch_us;
+        FakeTx.LinkEdgeJitter = fake_jitter_us;
+        FakeTx.LinkDelay = fake_delay_us;
+        FakeTx.LinkTo(&FakeRx);
+        FakeRx.SetSeed(2);
+        Tx.Open("fake0");
+        Rx.Open("fake1");
+    } else {
+        std::vector<std::string> DevList;
+        TiqiaaUsbIr::EnumDevices(DevList);
+        if (tx_index < 0 || rx_index < 0 || tx_index == rx_index || (size_t)tx_index >= DevList.size() || (size_t)rx_index >= DevList.size()) {
+            fprintf(stderr, "ERROR: Loopback needs two devices, %u found\n", (unsigned)DevList.size());
+            return 1;
+        }
+        Tx.Open(DevList[tx_index].c_str());
+        Rx.Open(DevList[rx_index].c_str());
+    }
+    if (!Tx.IsOpen() || !Rx.IsOpen()) {
+        fprintf(stderr, "ERROR: Unable to open the devices\n");
+        return 1;
+    }
+
+    fprintf(stderr, "INFO: Sending %u codes %d times\n", (unsigned)Loopback.Codes.size(), Loopback.Repeats);
+    bool res = Loopback.Run(Tx, Rx);
+    if (!res)
+        fprintf(stderr, "ERROR: Loopback run failed\n");
+    Loopback.WriteStats(stdout);
+    Tx.Close();
+    Rx.Close();
+    return res ? 0 : 1;
+}
+
+// Reply hand-off of one mechanism: waiter arms, signals producer and waits; producer completes after delay
+static void wake_bench_round(int mechanism, int iterations, int delay_us, std::vector<int64_t> &latency)
+{
+    TiqiaaUsbIr_Completion Completion;
+    HANDLE Event = CreateEvent(NULL, false, false, NULL);
+    std::atomic<int> round(0);
+    std::atomic<int64_t> complete_time(0);
+    std::atomic<int> signalled(0);
+
+    if (mechanism == 1)
+        Completion.SpinTime = 0;
+    std::thread producer([&]() {
+        for (int i = 1; i <= iterations; i++) {
+            while (round.load() != i)
+                std::this_thread::yield();
+            int64_t due = TiqiaaUsbIr::GetTimeNs() + (int64_t)delay_us * 1000;
+            while (TiqiaaUsbIr::GetTimeNs() < due);
+            complete_time.store(TiqiaaUsbIr::GetTimeNs());
+            if (mechanism == 0)
+                SetEvent(Event);
+            else
+                Completion.Complete((uint32_t)i & 0xFFFF);
+            signalled.store(i);
+        }
+    });
+    latency.clear();
+    for (int i = 1; i <= iterations; i++) {
+        bool res;
+        if (mechanism != 0)
+            Completion.Arm((uint32_t)i & 0xFFFF);
+        round.store(i);
+        if (mechanism == 0)
+            res = WaitForSingleObject(Event, 1000) == WAIT_OBJECT_0;
+        else
+            res = Completion.Wait(1000);
+        int64_t wake_time = TiqiaaUsbIr::GetTimeNs();
+        if (res) {
+            latency.push_back(wake_time - complete_time.load());
+        } else {
+            // Late signal of a timed out round must not wake the next one
+            if (mechanism != 0)
+                Completion.Cancel();
+            while (signalled.load() != i)
+                std::this_thread::yield();
+            if (mechanism == 0)
+                ResetEvent(Event);
+        }
+    }
+    producer.join();
+    CloseHandle(Event);
+}
+
+static int run_wake_bench(int argc, char *argv[])
+{
+    static const char *names[] = { "event", "completion_nospin", "completion" };
+    std::vector<int> delays;
+    std::vector<int64_t> latency;
+    int iterations = 10000;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:")) != -1)
+    {
+        switch (c)
+        {
+            case 'n':
+                iterations = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "%s", usage);
+                return 1;
+        }
+    }
+    for (int i = optind; i < argc; i++)
+        delays.push_back(atoi(argv[i]));
+    if (delays.empty()) {
+        delays.push_back(0);
+        delays.push_back(100);
+        delays.push_back(1000);
+    }
+
+    printf("mechanism,delay_us,wakes,p50_us,p90_us,p99_us,max_us\n");
+    for (size_t d = 0; d < delays.size(); d++) {
+        for (int mechanism = 0; mechanism < 3; mechanism++) {
+            wake_bench_round(mechanism, iterations, delays[d], latency);
+            if (latency.empty())
+                continue;
+            std::sort(latency.begin(), latency.end());
+            printf("%s,%d,%u,%.2f,%.2f,%.2f,%.2f\n", names[mechanism], delays[d], (unsigned)latency.size(),
+                   latency[latency.size() * 50 / 100] / 1000.0, latency[latency.size() * 90 / 100] / 1000.0,
+                   latency[latency.size() * 99 / 100] / 1000.0, latency.back() / 1000.0);
+            fflush(stdout);
+        }
+    }
+    return 0;
+}
 
 int main(int argc, char *argv[])
 {
     int err = 0;
     int c;
+    bool use_fake = false;
+    double fake_drop_pct = 0;
+    unsigned fake_delay_ms = 0;
+    unsigned fake_jitter_ms = 0;
+    const char *replay_path = NULL;
+    double replay_speed = 1;
+    std::string replay_arg;
+    TiqiaaUsbTraceWriter Recorder;
+    IrMatchIndex Index;
 
-    while ((c = getopt(argc, argv, "hr:s:")) != -1)
+    // Subcommands take their own options, argv[1] acts as program name for getopt
+    if (argc > 1 && strcmp(argv[1], "--batch") == 0)
+        return run_batch(argc - 1, argv + 1);
+    if (argc > 1 && strcmp(argv[1], "--match-bench") == 0)
+        return run_match_bench(argc - 1, argv + 1);
+    if (argc > 1 && strcmp(argv[1], "--convert") == 0)
+        return run_convert(argc - 1, argv + 1);
+    if (argc > 1 && strcmp(argv[1], "--convert-bench") == 0)
+        return run_convert_bench(argc - 1, argv + 1);
+    if (argc > 1 && strcmp(argv[1], "--loopback") == 0)
+        return run_loopback(argc - 1, argv + 1);
+    if (argc > 1 && strcmp(argv[1], "--wake-bench") == 0)
+        return run_wake_bench(argc - 1, argv + 1);
+
+    // Event trace covers the whole session, the option is removed before getopt sees the rest
+    const char *event_trace_path = NULL;
+    if (argc > 2 && strcmp(argv[1], "--trace") == 0)
+    {
+        event_trace_path = argv[2];
+        argv[2] = argv[0];
+        argv += 2;
+        argc -= 2;
+        TIQIAA_TRACE_THREAD_NAME("main");
+        TiqiaaEventTrace::Enable(true);
+    }
+
+    while ((c = getopt(argc, argv, "hr:s:H:q:F:P:w:m:")) != -1)
     {
         switch (c)
         {
@@ -40,7 +786,49 @@ int main(int argc, char *argv[])
                 return EXIT_SUCCESS;
             case 's':
             case 'r':
+            case 'q':
                 break; // Just check it's ok
+            case 'H':
+            {
+                unsigned long code;
+                long hold_ms;
+                if (!parse_hold(optarg, &code, &hold_ms))
+                {
+                    fprintf(stderr, "ERROR: Invalid hold argument: %s\n", optarg);
+                    fprintf(stderr, "%s", usage);
+                    return 1;
+                }
+                break;
+            }
+            case 'F':
+                use_fake = true;
+                sscanf(optarg, "%lf,%u,%u", &fake_drop_pct, &fake_delay_ms, &fake_jitter_ms);
+                break;
+            case 'P':
+                replay_arg = optarg;
+                if (replay_arg.find(',') != std::string::npos)
+                {
+                    replay_speed = atof(replay_arg.c_str() + replay_arg.find(',') + 1);
+                    replay_arg.resize(replay_arg.find(','));
+                }
+                replay_path = replay_arg.c_str();
+                break;
+            case 'w':
+                if (!Recorder.Open(optarg))
+                {
+                    fprintf(stderr, "ERROR: Unable to create trace file %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'm':
+                if (Index.LoadLibrary(optarg) < 0)
+                {
+                    fprintf(stderr, "ERROR: Unable to read signal library %s\n", optarg);
+                    return 1;
+                }
+                fprintf(stderr, "INFO: Loaded %u signals from %s\n", (unsigned)Index.GetCount(), optarg);
+                match_index = &Index;
+                break;
             case '?':
                 if (isprint(optopt))
                   fprintf(stderr, "ERROR: Unknown option `-%c'.\n", optopt);
@@ -52,10 +840,30 @@ int main(int argc, char *argv[])
         }
     }
 
-    TiqiaaUsbIr Ir;
+    TiqiaaUsbIr RealIr;
+    TiqiaaFakeUsbIr FakeIr;
+    TiqiaaReplayUsbIr ReplayIr;
+    TiqiaaUsbIr &Ir = use_fake ? FakeIr : (replay_path ? ReplayIr : RealIr);
     Ir.IrRecvCallback = test_callback;
+    if (Recorder.IsOpen())
+        Ir.TrafficRecorder = &Recorder;
     std::vector<std::string> DevList;
-    if (Ir.EnumDevices(DevList))
+    if (replay_path)
+    {
+        ReplayIr.Speed = replay_speed;
+        if (ReplayIr.LoadTrace(replay_path))
+            Ir.Open("replay");
+        else
+            fprintf(stderr, "ERROR: Unable to load trace %s\n", replay_path);
+    }
+    else if (use_fake)
+    {
+        FakeIr.DropReplyRate = fake_drop_pct / 100;
+        FakeIr.ReplyDelay = fake_delay_ms;
+        FakeIr.ReplyDelayJitter = fake_jitter_ms;
+        Ir.Open("fake");
+    }
+    else if (Ir.EnumDevices(DevList))
     {
         if (DevList.size() > 0)
         {
@@ -68,38 +876,50 @@ int main(int argc, char *argv[])
         fprintf(stderr, "INFO: Device opened\n");
 
         for( int i = 1; i < argc; i += 2 ) {
-            bool send = argv[i][1] == 's';
-            if( send ) {
-                fprintf(stderr, "INFO: Reading signal from file: %s\n", argv[i+1]);
-                io_file = fopen(argv[i+1], "rb");
-            } else {
-                fprintf(stderr, "INFO: Writing signal to file: %s\n", argv[i+1]);
-                io_file = fopen(argv[i+1], "wb");
+            if( argv[i][1] == 'F' || argv[i][1] == 'P' || argv[i][1] == 'w' || argv[i][1] == 'm' )
+                continue;
+            if( argv[i][1] == 'H' ) {
+                hold_button(Ir, argv[i+1]);
+                continue;
             }
-            if( !io_file ) {
-                fprintf(stderr, "ERROR: Unable to open file\n");
-                return 1;
+            if( argv[i][1] == 'q' ) {
+                play_timeline(Ir, DevList, argv[i+1]);
+                continue;
             }
 
-            if( send ) {
-                uint8_t *buffer;
-                long size;
-                // Get file size
-                fseek(io_file, 0, SEEK_END);
-                size = ftell(io_file);
-                rewind(io_file);
+            if( argv[i][1] == 's' ) {
+                std::string path = argv[i+1];
+                std::vector<uint8_t> signal;
+                int freq = IrSignal::DefaultFreq;
+                // Optional carrier freq follows the path after comma
+                size_t comma = path.rfind(',');
+                if( comma != std::string::npos ) {
+                    char *end;
+                    long value = strtol(path.c_str() + comma + 1, &end, 10);
+                    if( end != path.c_str() + comma + 1 && *end == 0 && value > 0 ) {
+                        freq = (int)value;
+                        path.resize(comma);
+                    }
+                }
+                fprintf(stderr, "INFO: Reading signal from file: %s\n", path.c_str());
+                // Signal can't be empty or exceed one device packet
+                if( !TiqiaaUsbIr::ReadIrSignalFile(path.c_str(), signal) ) {
+                    fprintf(stderr, "ERROR: Unable to read signal file, it must exist and be 1..%d bytes\n", TiqiaaUsbIr_MaxPacketSize);
+                    return 1;
+                }
 
-                buffer = (uint8_t*)malloc(sizeof(uint8_t)*size);
-                fread(buffer, sizeof(uint8_t), size, io_file);
-                fclose(io_file);
-
-                if( Ir.SendIR(38000, buffer, size) ) {
+                if( Ir.SendIR(freq, &signal[0], (int)signal.size()) ) {
                     fprintf(stderr, "INFO: Sent IR signal\n");
                 } else
                     fprintf(stderr, "ERROR: Unable to send IR\n");
-
-                free(buffer);
             } else {
+                fprintf(stderr, "INFO: Writing signal to file: %s\n", argv[i+1]);
+                io_file = fopen(argv[i+1], "wb");
+                if( !io_file ) {
+                    fprintf(stderr, "ERROR: Unable to open file\n");
+                    return 1;
+                }
+
                 signal_received = false;
                 if( Ir.StartRecvIR() ) {
                     fprintf(stderr, "INFO: Waiting for IR signal\n");
@@ -114,6 +934,24 @@ int main(int argc, char *argv[])
 
     fprintf(stderr, "INFO: Closing device\n");
     Ir.Close();
+    Recorder.Close();
+    if (event_trace_path)
+    {
+        TiqiaaEventTrace::Enable(false);
+        if (TiqiaaEventTrace::WriteChromeJson(event_trace_path))
+            fprintf(stderr, "INFO: Event trace written to %s\n", event_trace_path);
+        else
+            fprintf(stderr, "ERROR: Unable to write event trace %s\n", event_trace_path);
+    }
+    if (use_fake)
+        fprintf(stderr, "INFO: Simulated device dropped %ld replies\n", (long)FakeIr.DroppedReplyCount);
+    if (replay_path)
+    {
+        int count;
+        int64_t bytes, elapsed;
+        ReplayIr.GetReplayStats(&count, &bytes, &elapsed);
+        fprintf(stderr, "INFO: Replayed %d reports (%lld bytes) in %.3f ms\n", count, (long long)bytes, elapsed / 1000000.0);
+    }
 
     return err >= 0 ? err : -err;
 }
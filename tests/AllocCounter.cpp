@@ -0,0 +1,70 @@
+/*
+ * Heap allocation counter for allocation-free path tests
+ */
+
+#include "AllocCounter.h"
+#include <stdlib.h>
+#include <atomic>
+#include <new>
+#if defined(_MSC_VER) && defined(_DEBUG)
+#include <crtdbg.h>
+#endif
+
+static std::atomic<int64_t> Allocs(0);
+
+#if defined(_MSC_VER) && defined(_DEBUG)
+//operator new of debug CRT goes through malloc, so it is counted here
+static int CountingAllocHook(int allocType, void * userData, size_t size, int blockType, long requestNumber, const unsigned char * fileName, int lineNumber){
+	if ((allocType == _HOOK_ALLOC) || (allocType == _HOOK_REALLOC)) Allocs ++;
+	return TRUE;
+}
+
+static int AllocHookInstalled = (_CrtSetAllocHook(CountingAllocHook), 0);
+#endif
+
+int64_t AllocCount(){
+	return Allocs.load();
+}
+
+void * operator new(size_t size){
+	void * p;
+
+#if !(defined(_MSC_VER) && defined(_DEBUG))
+	Allocs ++;
+#endif
+	p = malloc((size != 0) ? size : 1);
+	if (p == NULL) throw std::bad_alloc();
+	return p;
+}
+
+void * operator new[](size_t size){
+	return operator new(size);
+}
+
+void * operator new(size_t size, const std::nothrow_t &) noexcept{
+	try {
+		return operator new(size);
+	} catch (...){
+		return NULL;
+	}
+}
+
+void * operator new[](size_t size, const std::nothrow_t &) noexcept{
+	return operator new(size, std::nothrow);
+}
+
+void operator delete(void * p) noexcept{
+	free(p);
+}
+
+void operator delete[](void * p) noexcept{
+	free(p);
+}
+
+void operator delete(void * p, size_t) noexcept{
+	free(p);
+}
+
+void operator delete[](void * p, size_t) noexcept{
+	free(p);
+}
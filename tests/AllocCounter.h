@@ -0,0 +1,16 @@
+/*
+ * Heap allocation counter for allocation-free path tests
+ *
+ * Global operator new is replaced to count allocations of all threads; with debug CRT malloc
+ * is counted as well.
+ */
+
+#ifndef IR_USB_ALLOC_COUNTER_H
+#define IR_USB_ALLOC_COUNTER_H
+
+#include <stdint.h>
+
+//! Return: number of heap allocations since process start
+int64_t AllocCount();
+
+#endif
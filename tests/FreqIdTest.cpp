@@ -0,0 +1,39 @@
+/*
+ * Carrier freq to freq ID mapping against direct nearest search over TiqiaaUsbIr_IrFreqTable
+ */
+
+#include "Test.h"
+#include "TiqiaaUsb.h"
+#include <stdlib.h>
+
+static int NearestFreqId(int freq){
+	int k, Best = 0;
+
+	for (k = 1; k < TiqiaaUsbIr_IrFreqTableSize; k++){
+		if (abs(TiqiaaUsbIr_IrFreqTable[k] - freq) < abs(TiqiaaUsbIr_IrFreqTable[Best] - freq)) Best = k;
+	}
+	return Best;
+}
+
+TEST_CASE(FreqIdMatchesNearestSearch){
+	int Freq;
+	int Errors = 0;
+
+	for (Freq = 256; Freq <= 65535; Freq++){
+		if (TiqiaaUsbIr::GetIrFreqId(Freq) != NearestFreqId(Freq)) Errors++;
+	}
+	TEST_CHECK(Errors == 0);
+}
+
+TEST_CASE(FreqIdCloseTableValues){
+	int k;
+
+	for (k = 0; k < TiqiaaUsbIr_IrFreqTableSize; k++) TEST_CHECK(TiqiaaUsbIr::GetIrFreqId(TiqiaaUsbIr_IrFreqTable[k]) == k);
+	//37900 and 37917 are 17 Hz apart, midpoint is 37908.5
+	TEST_CHECK(TiqiaaUsbIr::GetIrFreqId(37908) == 1);
+	TEST_CHECK(TiqiaaUsbIr::GetIrFreqId(37909) == 2);
+	TEST_CHECK(TiqiaaUsbIr::GetIrFreqId(7) == 7);
+	TEST_CHECK(TiqiaaUsbIr::GetIrFreqId(30) == -1);
+	TEST_CHECK(TiqiaaUsbIr::GetIrFreqId(-1) == -1);
+	TEST_CHECK(TiqiaaUsbIr::GetIrFreqId(100000) == TiqiaaUsbIr::GetIrFreqId(65535));
+}
@@ -0,0 +1,61 @@
+/*
+ * Nearest-match lookup with tolerance out of range
+ */
+
+#include "Test.h"
+#include "IrMatchIndex.h"
+
+static void MakeSignal(IrSignal &signal, uint32_t bits, uint32_t scale){
+	int i;
+
+	signal.Freq = IrSignal::DefaultFreq;
+	signal.Durations.clear();
+	signal.Durations.push_back(9000);
+	signal.Durations.push_back(4500);
+	for (i = 0; i < 16; i++){
+		signal.Durations.push_back(560 * scale / 100);
+		signal.Durations.push_back((((bits >> i) & 1) ? 1690 : 560) * scale / 100);
+	}
+	signal.Durations.push_back(560);
+	signal.Durations.push_back(20000);
+}
+
+static bool SameMatch(const IrMatchResult &a, const IrMatchResult &b){
+	return (a.Index == b.Index) && (a.InTolerance == b.InTolerance) && (a.Excess == b.Excess) && (a.MeanError == b.MeanError);
+}
+
+TEST_CASE(IrMatchIndexToleranceIsClamped){
+	IrMatchIndex Index;
+	IrSignal Signal;
+	IrMatchResult Clamped;
+	IrMatchResult Limit;
+	uint32_t k;
+
+	for (k = 0; k < 16; k++){
+		MakeSignal(Signal, k * 0x1111, 100);
+		TEST_CHECK(Index.Add("code", Signal));
+	}
+	Index.Build();
+	//edges 80% longer than library ones are within the max tolerance only
+	MakeSignal(Signal, 0x3333, 180);
+
+	Index.Tolerance = IrMatchIndex::MaxTolerance;
+	TEST_CHECK(Index.Find(Signal, &Limit));
+	TEST_CHECK(Limit.InTolerance);
+	Index.Tolerance = 100; //used to divide by zero
+	TEST_CHECK(Index.Find(Signal, &Clamped));
+	TEST_CHECK(SameMatch(Clamped, Limit));
+	Index.Tolerance = 1000;
+	TEST_CHECK(Index.Find(Signal, &Clamped));
+	TEST_CHECK(SameMatch(Clamped, Limit));
+
+	Index.Tolerance = 0;
+	Index.MinTolerance = 0;
+	MakeSignal(Signal, 0x3333, 100);
+	TEST_CHECK(Index.Find(Signal, &Limit));
+	TEST_CHECK(Limit.Index == 3);
+	Index.Tolerance = -10;
+	Index.MinTolerance = -10;
+	TEST_CHECK(Index.Find(Signal, &Clamped));
+	TEST_CHECK(SameMatch(Clamped, Limit));
+}
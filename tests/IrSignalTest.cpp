@@ -0,0 +1,48 @@
+/*
+ * Code format conversions of IrSignal
+ */
+
+#include "Test.h"
+#include "IrSignal.h"
+#include "IrCodeReader.h"
+#include <stdlib.h>
+#include <string.h>
+
+//NEC address 0x10, command 0xEF, raw code ends with stop mark
+static const char LircNec[] =
+	"begin remote\n"
+	"  name test\n"
+	"  flags RAW_CODES\n"
+	"  frequency 38000\n"
+	"  begin raw_codes\n"
+	"    name KEY_POWER\n"
+	"      9000 4500  560  560  560  560  560  560  560  560\n"
+	"       560 1690  560  560  560  560  560  560  560 1690\n"
+	"       560 1690  560 1690  560 1690  560  560  560 1690\n"
+	"       560 1690  560 1690  560 1690  560 1690  560 1690\n"
+	"       560 1690  560  560  560 1690  560 1690  560 1690\n"
+	"       560  560  560  560  560  560  560  560  560 1690\n"
+	"       560  560  560  560  560  560  560\n"
+	"  end raw_codes\n"
+	"end remote\n";
+
+TEST_CASE(IrSignalLircToProntoKeepsStopMark){
+	IrCodeReader Reader;
+	IrSignal Lirc;
+	IrSignal Pronto;
+	std::string Name;
+	std::string Text;
+	size_t i;
+
+	Reader.OpenBuffer(LircNec, strlen(LircNec), IrSignal::FormatLirc);
+	TEST_CHECK(Reader.Next(Lirc, Name));
+	TEST_CHECK(Lirc.Durations.size() == 67);
+	Lirc.WritePronto(Text);
+	TEST_CHECK(Pronto.ParsePronto(Text.c_str()));
+	//34 marks of lirc code, trailing gap is appended after stop mark
+	TEST_CHECK(Pronto.Durations.size() == 68);
+	TEST_CHECK((Pronto.Durations.size() + 1) / 2 == (Lirc.Durations.size() + 1) / 2);
+	TEST_CHECK(Pronto.Durations.back() >= (uint32_t)IrSignal::DefaultTrailingGap - 30);
+	//one carrier period of rounding per edge
+	for (i = 0; (i < Lirc.Durations.size()) && (i < Pronto.Durations.size()); i++) TEST_CHECK(abs((int)Pronto.Durations[i] - (int)Lirc.Durations[i]) <= 30);
+}
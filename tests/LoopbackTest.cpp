@@ -0,0 +1,112 @@
+/*
+ * Loopback results against two linked simulated devices with known channel model
+ */
+
+#include "Test.h"
+#include "TiqiaaFakeUsb.h"
+#include "IrLoopback.h"
+#include <stdlib.h>
+
+static const int Repeats = 3;
+static const int64_t LatencySlack = 100000000; //nsec, scheduling delay allowed on loaded hosts
+
+static bool RunLinked(IrLoopback &Loopback, int stretch, int jitter, int delay){
+	TiqiaaFakeUsbIr Tx;
+	TiqiaaFakeUsbIr Rx;
+	bool res;
+
+	Tx.LinkMarkStretch = stretch;
+	Tx.LinkEdgeJitter = jitter;
+	Tx.LinkDelay = delay;
+	Tx.SetSeed(1);
+	Tx.LinkTo(&Rx);
+	if (!Tx.Open("fake0") || !Rx.Open("fake1")) return false;
+	Loopback.AddDefaultCodes();
+	Loopback.Repeats = Repeats;
+	Loopback.Interval = 0;
+	res = Loopback.Run(Tx, Rx);
+	Tx.Close();
+	Rx.Close();
+	return res;
+}
+
+static void CheckReceived(IrLoopback &Loopback, int delay){
+	size_t Total = 0;
+	size_t i;
+
+	for (i = 0; i < Loopback.Codes.size(); i++){
+		TEST_CHECK(Loopback.Codes[i].Sent == Repeats);
+		TEST_CHECK(Loopback.Codes[i].Received == Repeats);
+		TEST_CHECK(Loopback.Codes[i].Empty == 0);
+		TEST_CHECK(Loopback.Codes[i].EdgeMismatch == 0);
+		Total += Loopback.Codes[i].Received;
+	}
+	TEST_CHECK(Total > 0);
+	TEST_CHECK(Loopback.Latency.size() == Total);
+	TEST_CHECK(Loopback.Overhead.size() == Total);
+	//linked receiver reports signal delay usec after its transmission ends
+	for (i = 0; i < Loopback.Overhead.size(); i++){
+		TEST_CHECK(Loopback.Overhead[i] >= (int64_t)delay * 1000);
+		TEST_CHECK(Loopback.Overhead[i] < (int64_t)delay * 1000 + LatencySlack);
+		TEST_CHECK(Loopback.Latency[i] > Loopback.Overhead[i]);
+	}
+}
+
+static double Mean(const std::vector<int> &errors){
+	double Sum = 0;
+	size_t i;
+
+	for (i = 0; i < errors.size(); i++) Sum += errors[i];
+	return errors.empty() ? 0 : Sum / errors.size();
+}
+
+TEST_CASE(LoopbackStretchAndDelay){
+	static const int Stretch = 3 * IrLoopback::HistStep;
+	static const int Delay = 3000;
+	IrLoopback Loopback;
+	int MarkHist[2 * IrLoopback::HistBins + 1];
+	int SpaceHist[2 * IrLoopback::HistBins + 1];
+	size_t i;
+
+	TEST_CHECK(RunLinked(Loopback, Stretch, 0, Delay));
+	CheckReceived(Loopback, Delay);
+	TEST_CHECK(!Loopback.MarkErrors.empty());
+	TEST_CHECK(!Loopback.SpaceErrors.empty());
+	//whole-tick stretch without jitter survives encoding exactly: marks longer, spaces shorter by it
+	for (i = 0; i < Loopback.MarkErrors.size(); i++) TEST_CHECK(Loopback.MarkErrors[i] == Stretch);
+	for (i = 0; i < Loopback.SpaceErrors.size(); i++) TEST_CHECK(Loopback.SpaceErrors[i] == -Stretch);
+	IrLoopback::GetErrorHist(Loopback.MarkErrors, MarkHist);
+	IrLoopback::GetErrorHist(Loopback.SpaceErrors, SpaceHist);
+	TEST_CHECK(MarkHist[IrLoopback::HistBins + 3] == (int)Loopback.MarkErrors.size());
+	TEST_CHECK(SpaceHist[IrLoopback::HistBins - 3] == (int)Loopback.SpaceErrors.size());
+}
+
+TEST_CASE(LoopbackEdgeJitter){
+	static const int Stretch = 40;
+	static const int Jitter = 24;
+	static const int Delay = 1000;
+	//duration error is difference of two edge errors, plus rounding to signal ticks
+	static const int MaxError = 2 * Jitter + IrSignal::TickSize;
+	IrLoopback Loopback;
+	int MarkHist[2 * IrLoopback::HistBins + 1];
+	int SpaceHist[2 * IrLoopback::HistBins + 1];
+	int Bin;
+	int Count;
+	size_t i;
+
+	TEST_CHECK(RunLinked(Loopback, Stretch, Jitter, Delay));
+	CheckReceived(Loopback, Delay);
+	for (i = 0; i < Loopback.MarkErrors.size(); i++) TEST_CHECK(abs(Loopback.MarkErrors[i] - Stretch) <= MaxError);
+	for (i = 0; i < Loopback.SpaceErrors.size(); i++) TEST_CHECK(abs(Loopback.SpaceErrors[i] + Stretch) <= MaxError);
+	TEST_CHECK(abs(Mean(Loopback.MarkErrors) - Stretch) <= IrLoopback::HistStep);
+	TEST_CHECK(abs(Mean(Loopback.SpaceErrors) + Stretch) <= IrLoopback::HistStep);
+	//every error falls into histogram bins around the stretch
+	IrLoopback::GetErrorHist(Loopback.MarkErrors, MarkHist);
+	IrLoopback::GetErrorHist(Loopback.SpaceErrors, SpaceHist);
+	Count = 0;
+	for (Bin = (Stretch - MaxError) / IrLoopback::HistStep - 1; Bin <= (Stretch + MaxError) / IrLoopback::HistStep + 1; Bin++) Count += MarkHist[IrLoopback::HistBins + Bin];
+	TEST_CHECK(Count == (int)Loopback.MarkErrors.size());
+	Count = 0;
+	for (Bin = (-Stretch - MaxError) / IrLoopback::HistStep - 1; Bin <= (-Stretch + MaxError) / IrLoopback::HistStep + 1; Bin++) Count += SpaceHist[IrLoopback::HistBins + Bin];
+	TEST_CHECK(Count == (int)Loopback.SpaceErrors.size());
+}
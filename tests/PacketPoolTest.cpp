@@ -0,0 +1,128 @@
+/*
+ * Zero heap allocations per SendIR and per received frame after warm-up, replies with exhausted pool
+ */
+
+#include "Test.h"
+#include "AllocCounter.h"
+#include "TiqiaaFakeUsb.h"
+
+static const int Iterations = 200;
+static const DWORD RecvTimeout = 1000;
+
+struct RecvCounter{
+	HANDLE Event;
+	volatile LONG Count;
+	int LastSize;
+};
+
+static void CountFrame(TiqiaaUsbIr_PacketBuf * frame, TiqiaaUsbIr * IrCls, void * context){
+	RecvCounter * Counter = (RecvCounter *)context;
+
+	Counter->LastSize = frame->Size;
+	InterlockedIncrement(&Counter->Count);
+	SetEvent(Counter->Event);
+}
+
+static bool ReceiveOne(TiqiaaFakeUsbIr &Ir, RecvCounter &Counter, const uint8_t * data, int size){
+	if (!Ir.StartRecvIR()) return false;
+	if (!Ir.InjectIrSignal(data, size)) return false;
+	return WaitForSingleObject(Counter.Event, RecvTimeout) == WAIT_OBJECT_0;
+}
+
+TEST_CASE(PacketPoolNoAllocPerSendAndReceive){
+	//short signal, so each send waits only for 0.5 ms of simulated airtime
+	static const uint8_t Signal[] = {0x80 | 16, 16};
+	TiqiaaFakeUsbIr Ir;
+	RecvCounter Counter;
+	int64_t Start;
+	int SendOk = 0;
+	int RecvOk = 0;
+	int i;
+
+	Counter.Event = CreateEvent(NULL, false, false, NULL);
+	Counter.Count = 0;
+	Counter.LastSize = 0;
+	Ir.IrRecvFrameCallback = CountFrame;
+	Ir.IrRecvCbContext = &Counter;
+	TEST_CHECK(Ir.Open("fake"));
+
+	//warm-up: mode switches, first RTT samples, lazily created state
+	TEST_CHECK(Ir.SendIR(38000, (void *)Signal, sizeof(Signal)));
+	TEST_CHECK(ReceiveOne(Ir, Counter, Signal, sizeof(Signal)));
+	TEST_CHECK(Ir.SendIR(38000, (void *)Signal, sizeof(Signal)));
+
+	Start = AllocCount();
+	for (i = 0; i < Iterations; i++){
+		if (Ir.SendIR(38000, (void *)Signal, sizeof(Signal))) SendOk ++;
+	}
+	TEST_CHECK(SendOk == Iterations);
+	TEST_CHECK(AllocCount() - Start == 0);
+
+	TEST_CHECK(ReceiveOne(Ir, Counter, Signal, sizeof(Signal)));
+	Start = AllocCount();
+	for (i = 0; i < Iterations; i++){
+		if (ReceiveOne(Ir, Counter, Signal, sizeof(Signal))) RecvOk ++;
+	}
+	TEST_CHECK(RecvOk == Iterations);
+	TEST_CHECK(Counter.LastSize == (int)sizeof(Signal));
+	TEST_CHECK(AllocCount() - Start == 0);
+
+	Ir.Close();
+	CloseHandle(Counter.Event);
+}
+
+struct FrameHolder{
+	HANDLE Event;
+	std::vector<TiqiaaUsbIr_PacketBuf *> Frames;
+};
+
+static void HoldFrame(TiqiaaUsbIr_PacketBuf * frame, TiqiaaUsbIr * IrCls, void * context){
+	FrameHolder * Holder = (FrameHolder *)context;
+
+	frame->AddRef();
+	Holder->Frames.push_back(frame);
+	SetEvent(Holder->Event);
+}
+
+TEST_CASE(PacketPoolHeldFramesDontBlockReplies){
+	static const uint8_t Signal[] = {0x80 | 16, 16};
+	static const int MaxFrames = 64;
+	static const DWORD DropTimeout = 200; //msec, frame is dropped once pool is exhausted
+	TiqiaaFakeUsbIr Ir;
+	FrameHolder Holder;
+	size_t Held;
+	int i;
+
+	Holder.Event = CreateEvent(NULL, false, false, NULL);
+	Ir.IrRecvFrameCallback = HoldFrame;
+	Ir.IrRecvCbContext = &Holder;
+	TEST_CHECK(Ir.Open("fake"));
+
+	//hold every frame until receive buffers run out
+	for (i = 0; i < MaxFrames; i++){
+		if (!Ir.StartRecvIR() || !Ir.InjectIrSignal(Signal, sizeof(Signal))) break;
+		if (WaitForSingleObject(Holder.Event, DropTimeout) != WAIT_OBJECT_0) break;
+	}
+	TEST_CHECK(i < MaxFrames);
+	Held = Holder.Frames.size();
+	TEST_CHECK(Held > 0);
+
+	//mode switches and sends still get their replies
+	TEST_CHECK(Ir.SendIR(38000, (void *)Signal, sizeof(Signal)));
+	TEST_CHECK(Ir.SendNecSignal(0x10EF));
+	TEST_CHECK(Ir.StartRecvIR());
+	TEST_CHECK(Ir.SetIdleMode());
+	TEST_CHECK(Holder.Frames.size() == Held);
+
+	//released buffers deliver frames again
+	for (i = 0; i < (int)Holder.Frames.size(); i++) Holder.Frames[i]->Release();
+	Holder.Frames.clear();
+	TEST_CHECK(Ir.StartRecvIR());
+	TEST_CHECK(Ir.InjectIrSignal(Signal, sizeof(Signal)));
+	TEST_CHECK(WaitForSingleObject(Holder.Event, RecvTimeout) == WAIT_OBJECT_0);
+	TEST_CHECK(Holder.Frames.size() == 1);
+	for (i = 0; i < (int)Holder.Frames.size(); i++) Holder.Frames[i]->Release();
+
+	Ir.Close();
+	CloseHandle(Holder.Event);
+}
@@ -0,0 +1,57 @@
+/*
+ * Held-button repeat against simulated device with failing writes
+ */
+
+#include "Test.h"
+#include "TiqiaaFakeUsb.h"
+
+static const DWORD ExitTimeout = 1000; //msec, repeat thread ends at next frame after write failure
+
+class FailingFakeUsbIr : public TiqiaaFakeUsbIr {
+	public:
+	volatile LONG FailWrites; //fail all report writes while set
+
+	FailingFakeUsbIr(){
+		FailWrites = 0;
+	}
+
+	protected:
+	virtual bool WriteReport(uint8_t * data, int size){
+		if (FailWrites) return false;
+		return TiqiaaFakeUsbIr::WriteReport(data, size);
+	}
+};
+
+TEST_CASE(RepeatRestartsAfterThreadFailed){
+	FailingFakeUsbIr Ir;
+	TiqiaaUsbIr_RepeatStats Stats;
+	int FrameCount;
+	int64_t Start;
+
+	TEST_CHECK(Ir.Open("fake"));
+	TEST_CHECK(Ir.StartRepeat(0x10EF));
+	Sleep(250);
+	Ir.GetRepeatStats(&Stats);
+	TEST_CHECK(Stats.FrameCount > 0);
+
+	//repeat thread exits on its own, no more frames are counted
+	InterlockedExchange(&Ir.FailWrites, 1);
+	Start = TiqiaaUsbIr::GetTimeNs();
+	do {
+		Ir.GetRepeatStats(&Stats);
+		FrameCount = Stats.FrameCount;
+		Sleep(250);
+		Ir.GetRepeatStats(&Stats);
+	} while ((Stats.FrameCount != FrameCount) && (TiqiaaUsbIr::GetTimeNs() - Start < (int64_t)ExitTimeout * 1000000));
+	TEST_CHECK(Stats.FrameCount == FrameCount);
+	InterlockedExchange(&Ir.FailWrites, 0);
+
+	//exited thread doesn't block new repeat
+	TEST_CHECK(Ir.StartRepeat(0x10EF));
+	Sleep(250);
+	Ir.GetRepeatStats(&Stats);
+	TEST_CHECK(Stats.FrameCount > 0);
+	TEST_CHECK(Ir.StopRepeat());
+	TEST_CHECK(!Ir.StopRepeat());
+	Ir.Close();
+}
@@ -0,0 +1,121 @@
+/*
+ * Adaptive reply timeouts and retries against dropped replies of simulated device
+ */
+
+#include "Test.h"
+#include "TiqiaaFakeUsb.h"
+
+static const int RttSamples = 4;
+static const DWORD TimeoutSlack = 100; //msec, scheduling delay allowed on loaded hosts
+
+static bool LastHostCmd(TiqiaaFakeUsbIr &Ir, int back, uint8_t * cmdId, uint8_t * cmdType){
+	return Ir.GetHostCmd(Ir.GetHostCmdCount() - 1 - back, cmdId, cmdType);
+}
+
+TEST_CASE(RetryDroppedNecReplyFailsInRttTimeout){
+	TiqiaaFakeUsbIr Ir;
+	TiqiaaUsbIr_RttEstimate Rtt;
+	uint8_t Buf[128];
+	int64_t Duration;
+	int64_t Expected;
+	int64_t Start;
+	int64_t Elapsed;
+	DWORD Timeout;
+	int i;
+
+	Duration = TiqiaaUsbIr::GetIrSignalDuration(Buf, TiqiaaUsbIr::WriteIrNecSignal(0x10EF, Buf));
+	Ir.RetryPolicy.IrRetries = 0;
+	TEST_CHECK(Ir.Open("fake"));
+	for (i = 0; i < RttSamples; i++) TEST_CHECK(Ir.SendNecSignal(0x10EF));
+	Ir.GetRttEstimate(TiqiaaUsbIr::CmdOutput, &Rtt);
+	TEST_CHECK(Rtt.SampleCount == RttSamples);
+
+	//SRTT + 4 * RTTVAR within policy limits, on top of signal duration
+	Expected = (Rtt.Srtt + 4 * Rtt.RttVar + 999999) / 1000000;
+	if (Expected < (int64_t)Ir.RetryPolicy.MinTimeout) Expected = Ir.RetryPolicy.MinTimeout;
+	if (Expected > (int64_t)Ir.RetryPolicy.MaxTimeout) Expected = Ir.RetryPolicy.MaxTimeout;
+	Expected += (Duration + 999999) / 1000000;
+	Timeout = Ir.GetReplyTimeout(TiqiaaUsbIr::CmdOutput, Duration);
+	TEST_CHECK((int64_t)Timeout == Expected);
+	//simulated device replies within a millisecond, so timeout is far below the 2 s default
+	TEST_CHECK(Timeout < Duration / 1000000 + 2000 - TimeoutSlack);
+
+	Ir.DropNextReplies = 1;
+	Start = TiqiaaUsbIr::GetTimeNs();
+	TEST_CHECK(!Ir.SendNecSignal(0x10EF));
+	Elapsed = (TiqiaaUsbIr::GetTimeNs() - Start) / 1000000;
+	TEST_CHECK(Elapsed + 1 >= (int64_t)Timeout);
+	TEST_CHECK(Elapsed <= (int64_t)(Timeout + TimeoutSlack));
+	TEST_CHECK(Ir.DroppedReplyCount == 1);
+
+	//failed send is not an RTT sample
+	Ir.GetRttEstimate(TiqiaaUsbIr::CmdOutput, &Rtt);
+	TEST_CHECK(Rtt.SampleCount == RttSamples);
+	Ir.Close();
+}
+
+TEST_CASE(RetryIrSendUsesFreshCmdIdAndSkipsRttSample){
+	TiqiaaFakeUsbIr Ir;
+	TiqiaaUsbIr_RttEstimate Rtt;
+	uint8_t Id1, Id2, Type1, Type2;
+	int i;
+
+	Ir.RetryPolicy.IrRetries = 1;
+	TEST_CHECK(Ir.Open("fake"));
+	for (i = 0; i < RttSamples; i++) TEST_CHECK(Ir.SendNecSignal(0x10EF));
+
+	Ir.DropNextReplies = 1;
+	TEST_CHECK(Ir.SendNecSignal(0x10EF));
+	TEST_CHECK(Ir.DroppedReplyCount == 1);
+	TEST_CHECK(LastHostCmd(Ir, 1, &Id1, &Type1));
+	TEST_CHECK(LastHostCmd(Ir, 0, &Id2, &Type2));
+	TEST_CHECK((Type1 == TiqiaaUsbIr::CmdData) && (Type2 == TiqiaaUsbIr::CmdData));
+	TEST_CHECK(Id1 != Id2);
+
+	//reply of retried send may belong to either attempt, so it is not sampled
+	Ir.GetRttEstimate(TiqiaaUsbIr::CmdOutput, &Rtt);
+	TEST_CHECK(Rtt.SampleCount == RttSamples);
+
+	TEST_CHECK(Ir.SendNecSignal(0x10EF));
+	Ir.GetRttEstimate(TiqiaaUsbIr::CmdOutput, &Rtt);
+	TEST_CHECK(Rtt.SampleCount == RttSamples + 1);
+	Ir.Close();
+}
+
+TEST_CASE(RetryCommandUsesFreshCmdIds){
+	TiqiaaFakeUsbIr Ir;
+	TiqiaaUsbIr_RttEstimate Rtt;
+	uint8_t Ids[3];
+	uint8_t Type;
+	int Samples;
+	int i;
+
+	Ir.RetryPolicy.CmdRetries = 2;
+	TEST_CHECK(Ir.Open("fake"));
+	//collect RTT samples of idle mode command
+	for (i = 0; i < RttSamples; i++){
+		TEST_CHECK(Ir.SetIdleMode());
+		TEST_CHECK(Ir.SetSendMode());
+	}
+	Ir.GetRttEstimate(TiqiaaUsbIr::CmdIdleMode, &Rtt);
+	Samples = Rtt.SampleCount;
+	TEST_CHECK(Samples == RttSamples);
+
+	//two dropped replies, third attempt succeeds
+	Ir.DropNextReplies = 2;
+	TEST_CHECK(Ir.SetIdleMode());
+	TEST_CHECK(Ir.DroppedReplyCount == 2);
+	for (i = 0; i < 3; i++){
+		TEST_CHECK(LastHostCmd(Ir, 2 - i, &Ids[i], &Type));
+		TEST_CHECK(Type == TiqiaaUsbIr::CmdIdleMode);
+	}
+	TEST_CHECK((Ids[0] != Ids[1]) && (Ids[1] != Ids[2]) && (Ids[0] != Ids[2]));
+	Ir.GetRttEstimate(TiqiaaUsbIr::CmdIdleMode, &Rtt);
+	TEST_CHECK(Rtt.SampleCount == Samples);
+
+	//all attempts dropped
+	TEST_CHECK(Ir.SetSendMode());
+	Ir.DropNextReplies = 3;
+	TEST_CHECK(!Ir.SetIdleMode());
+	Ir.Close();
+}
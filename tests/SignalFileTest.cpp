@@ -0,0 +1,43 @@
+/*
+ * Signal data file reader shared by CLI, sequencer and loopback
+ */
+
+#include "Test.h"
+#include "TiqiaaUsb.h"
+#include <stdio.h>
+
+static const char * Path = "ir-usb-tests.bin";
+
+static bool WriteFile(const char * path, int size){
+	std::vector<uint8_t> Data(size + 1, 0x85);
+	FILE * f = fopen(path, "wb");
+
+	if (f == NULL) return false;
+	fwrite(&Data[0], 1, size, f);
+	fclose(f);
+	return true;
+}
+
+TEST_CASE(SignalFileSizeLimit){
+	std::vector<uint8_t> Data;
+
+	TEST_CHECK(WriteFile(Path, TiqiaaUsbIr_MaxPacketSize));
+	TEST_CHECK(TiqiaaUsbIr::ReadIrSignalFile(Path, Data));
+	TEST_CHECK(Data.size() == (size_t)TiqiaaUsbIr_MaxPacketSize);
+	TEST_CHECK(WriteFile(Path, TiqiaaUsbIr_MaxPacketSize + 1));
+	TEST_CHECK(!TiqiaaUsbIr::ReadIrSignalFile(Path, Data));
+	remove(Path);
+}
+
+TEST_CASE(SignalFileEmptyOrMissing){
+	std::vector<uint8_t> Data;
+
+	TEST_CHECK(WriteFile(Path, 0));
+	TEST_CHECK(!TiqiaaUsbIr::ReadIrSignalFile(Path, Data));
+	remove(Path);
+	TEST_CHECK(!TiqiaaUsbIr::ReadIrSignalFile(Path, Data));
+	TEST_CHECK(WriteFile(Path, 1));
+	TEST_CHECK(TiqiaaUsbIr::ReadIrSignalFile(Path, Data));
+	TEST_CHECK(Data.size() == 1);
+	remove(Path);
+}
@@ -0,0 +1,33 @@
+/*
+ * Minimal self-checking test runner
+ *
+ * Test cases register themselves at startup. ir-usb-tests runs all of them, or only those whose
+ * name contains the first argument, and exits with 1 if any check failed.
+ *
+ * Example:
+ *
+ * TEST_CASE(SignalRoundTrip){
+ * 	TEST_CHECK(Signal.DecodeBlocks(data, size));
+ * }
+ */
+
+#ifndef IR_USB_TEST_H
+#define IR_USB_TEST_H
+
+#include <stdio.h>
+
+typedef void TestFn();
+
+//! Register test case, used by TEST_CASE
+//! name: Test name
+//! fn: Test function
+//! Return: true
+bool TestRegister(const char * name, TestFn * fn);
+
+//! Record failed check, used by TEST_CHECK
+void TestFail(const char * file, int line, const char * expr);
+
+#define TEST_CASE(name) static void name(); static bool name##Registered = TestRegister(#name, name); static void name()
+#define TEST_CHECK(cond) do { if (!(cond)) TestFail(__FILE__, __LINE__, #cond); } while (0)
+
+#endif
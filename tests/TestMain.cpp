@@ -0,0 +1,49 @@
+/*
+ * Minimal self-checking test runner
+ */
+
+#include "Test.h"
+#include <string.h>
+
+struct TestCaseEntry{
+	const char * Name;
+	TestFn * Fn;
+};
+
+static const int MaxTests = 64;
+static TestCaseEntry Tests[MaxTests];
+static int TestCount = 0;
+static int FailCount = 0;
+
+bool TestRegister(const char * name, TestFn * fn){
+	if (TestCount < MaxTests){
+		Tests[TestCount].Name = name;
+		Tests[TestCount].Fn = fn;
+		TestCount ++;
+	}
+	return true;
+}
+
+void TestFail(const char * file, int line, const char * expr){
+	fprintf(stderr, "FAIL %s:%d: %s\n", file, line, expr);
+	FailCount ++;
+}
+
+int main(int argc, char * argv[]){
+	int Failed = 0;
+	int Run = 0;
+	int PrevFailCount;
+	int i;
+
+	for (i = 0; i < TestCount; i++){
+		if ((argc > 1) && (strstr(Tests[i].Name, argv[1]) == NULL)) continue;
+		PrevFailCount = FailCount;
+		Tests[i].Fn();
+		Run ++;
+		if (FailCount != PrevFailCount) Failed ++;
+		printf("%s %s\n", (FailCount != PrevFailCount) ? "FAIL" : "PASS", Tests[i].Name);
+		fflush(stdout);
+	}
+	printf("%d/%d tests passed\n", Run - Failed, Run);
+	return (Failed == 0) ? 0 : 1;
+}